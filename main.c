@@ -1,104 +1,4127 @@
+// Build with -DTRACK_ALLOCATIONS to count every malloc in the game loop, =2 aborts on a gameplay allocation
+// Build with -DPOOL_STATS to keep use and overflow counts in the DEFINE_POOL pools
+#if defined(TRACK_ALLOCATIONS)
+    #define _GNU_SOURCE     // dladdr names the allocation call sites
+#endif
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "raylib.h"
 #include "raymath.h"
 
-#define PLAYER_WIDTH 35
-#define PLAYER_HEIGHT 40
-#define ENEMY_WIDTH 35
-#define ENEMY_HEIGHT 40
-#define BULLET_RADIUS 5
-#define MAX_BULLETS 50
+#if defined(__unix__) || defined(__APPLE__)
+    #define PACK_USE_MMAP
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#if defined(TRACK_ALLOCATIONS)
+    #include <dlfcn.h>
+#endif
+
+#if defined(__GLIBC__)
+    #include <malloc.h>     // mallinfo2 for the soak test heap columns
+#endif
+
+// Raylib links GLFW in on desktop but does not ship its header, these are the only parts the game uses
+typedef struct GLFWwindow GLFWwindow;
+typedef void (*GLFWmousebuttonfun) (GLFWwindow *window, int button, int action, int mods);
+GLFWmousebuttonfun glfwSetMouseButtonCallback (GLFWwindow *window, GLFWmousebuttonfun callback);
+double glfwGetTime (void);
+
+#define GLFW_PRESS 1
+#define GLFW_MOUSE_BUTTON_LEFT 0
+
+#define PLAYER_WIDTH 35
+#define PLAYER_HEIGHT 40
+#define ENEMY_WIDTH 35
+#define ENEMY_HEIGHT 40
+#define BULLET_RADIUS 5
+#define MAX_BULLETS 2048
+#define MAX_ENEMIES 32768
+#define MAX_ENTITIES 65536
+#define MAX_ARCHETYPES 16
+#define MAX_CHUNKS 256
+#define CHUNK_BYTES (16*1024)
+#define SPRITE_SHAPE_SIZE 32
+#define SPRITE_BATCH_QUADS 16384
+#define GRID_CELL_SIZE 128.0f
+#define GRID_BUCKETS 4096
+#define FRAME_HISTORY 120
+#define DRS_WINDOW 30
+#define LAYER_KEY_BYTES 64
+#define IDLE_ANIMATION_FPS 30
+#define MAX_FRAME_TIME 0.1f
+#define TEXT_CACHE_RUNS 64
+#define TEXT_RUN_BYTES 64
+#define TEXT_RUN_GLYPHS 48
+#define ATLAS_MAX_SPRITES 32
+#define ATLAS_NAME_BYTES 32
+#define ATLAS_MAX_SIZE 4096
+#define ATLAS_PADDING 2
+#define ATLAS_PATH "resources/atlas/sprites"
+#define ATLAS_TABLE_BYTES (ATLAS_MAX_SPRITES*(ATLAS_NAME_BYTES + 32) + 64)
+#define PACK_MAGIC 0x4B505442u  // "BTPK"
+#define PACK_VERSION 2
+#define PACK_NAME_BYTES 32
+#define PACK_ALIGN 64
+#define PACK_PATH "resources/assets.pack"
+#define LOADER_WORKERS 4
+#define LOADER_MAX_JOBS 16
+#define LOADER_UPLOAD_BYTES (256*1024)
+#define LOADER_PATH_BYTES 256
+#define INPUT_QUEUE_SIZE 64
+#define SIM_MAX_CLICKS 16
+#define FRAME_ARENA_BYTES (64*1024)
+#define ARENA_ALIGN 16
+#define ARENA_POISON 0xCD
+#define PACING_WINDOW 30
+#define PACING_MARGIN 0.002f
+#define LATENCY_BINS 100
+#define LATENCY_PENDING 32
+#define SIM_QUEUE_DEPTH 2
+#define SNAPSHOT_SLOTS 3
+#define SNAPSHOT_SLOT_MASK 3u
+#define SNAPSHOT_FRESH 4u
+#define SOAK_TICK (1.0f/60.0f)
+#define SOAK_MAX_SAMPLES 1440     // Even, longer runs keep every other sample when it fills up
+#define SOAK_FRAME_BINS 1000
+#define SOAK_GAME_SECONDS 600.0f
+#define SOAK_WEAPON_SECONDS 20.0f
+#define SOAK_WARMUP_MINUTES 2
+#define SOAK_PATH "soak.csv"
+#define BENCH_WAVE 5
+#define BENCH_SEED 20240601
+#define BENCH_COLOR_TOLERANCE 8
+#define ALLOC_SITES 256
+#define ALLOC_WARMUP_FRAMES 120
+#define MAX_PARTICLES 4096
+#define PARTICLES_PER_KILL 8
+#define PARTICLE_LIFE 0.35f
+#define PARTICLE_SPEED 220.0f
+#define PARTICLE_SIZE 4.0f
+
+// Declares Type##Pool, a fixed-capacity pool with stable indices: free items sit on a stack, so acquire and
+// release are O(1) and a held item never moves. Acquire returns the index of the item, -1 when the pool is
+// full. Items are not cleared either way, they keep whatever they held last (handle generations rely on
+// this). With POOL_STATS, peak and failed count the highest use and the acquires that found the pool full.
+#if defined(POOL_STATS)
+    #define POOL_STATS_FIELDS int peak; int failed;
+    #define POOL_NOTE_ACQUIRED(pool, used) ((pool)->peak = ((used) > (pool)->peak) ? (used) : (pool)->peak)
+    #define POOL_NOTE_FAILED(pool) ((pool)->failed++)
+#else
+    #define POOL_STATS_FIELDS
+    #define POOL_NOTE_ACQUIRED(pool, used) ((void)0)
+    #define POOL_NOTE_FAILED(pool) ((void)0)
+#endif
+
+#define DEFINE_POOL(Type, capacity) \
+    typedef struct Type##Pool \
+    { \
+        Type items[capacity]; \
+        int freeItems[capacity]; \
+        int freeCount; \
+        POOL_STATS_FIELDS \
+    } Type##Pool; \
+    \
+    static inline void Init##Type##Pool (Type##Pool *pool) \
+    { \
+        *pool = (Type##Pool){ .freeCount = (capacity) }; \
+        for (int i = 0; i < (capacity); i++) pool->freeItems[i] = (capacity) - 1 - i; \
+    } \
+    \
+    static inline int Acquire##Type (Type##Pool *pool) \
+    { \
+        if (pool->freeCount == 0) \
+        { \
+            POOL_NOTE_FAILED (pool); \
+            return -1; \
+        } \
+        int index = pool->freeItems[--pool->freeCount]; \
+        POOL_NOTE_ACQUIRED (pool, (capacity) - pool->freeCount); \
+        return index; \
+    } \
+    \
+    static inline void Release##Type (Type##Pool *pool, int index) \
+    { \
+        pool->freeItems[pool->freeCount++] = index; \
+    }
+
+// 1. Enumerations and Structures
+// Define a GameState enum: MENU, GAMEPLAY, SETTINGS, etc.
+
+typedef enum
+{
+    STATE_LOADING,
+    STATE_START,
+    STATE_MENU, 
+    STATE_GAMEPLAY,
+    STATE_GAMEOVER
+} GameState;
+
+// Atlases are split by the states that draw them, so each can be resident on its own
+typedef enum
+{
+    ATLAS_TITLE,
+    ATLAS_GAME,
+    ATLAS_GROUP_COUNT
+} AtlasGroup;
+
+#define ATLAS_BIT(g) (1u << (g))
+
+typedef enum
+{
+    ENEMY_GRUNT,
+    ENEMY_RUNNER,
+    ENEMY_BRUTE,
+    ENEMY_TYPE_COUNT
+} EnemyType;
+
+typedef enum
+{
+    BULLET_STANDARD,
+    BULLET_PELLET,
+    BULLET_ROUND,
+    BULLET_TYPE_COUNT
+} BulletType;
+
+typedef enum
+{
+    WEAPON_PISTOL,
+    WEAPON_SHOTGUN,
+    WEAPON_MINIGUN,
+    WEAPON_COUNT
+} WeaponType;
+
+typedef enum
+{
+    PACING_VSYNC,           // Vsync plus a 60 fps cap
+    PACING_LOW_LATENCY,     // Vsync, input sampled as late as the predicted frame cost allows
+    PACING_UNCAPPED,        // No vsync, no cap, for benchmarks
+    PACING_MODE_COUNT
+} PacingMode;
+
+// Define Player struct
+typedef struct Player
+{
+    Vector2 position;
+    Vector2 direction;
+    float speed;
+    int health;
+    int maxHealth;
+    int dollars;
+    Rectangle rect;
+    WeaponType weapon;
+    float nextShot;         // Time until the weapon can fire again, counted from the start of the next tick
+    bool shotQueued;        // A click the weapon was not ready for yet, fired first next tick
+    Vector2 queuedAim;
+    int droppedShots;       // Clicks replaced by a newer one while waiting for the weapon
+} Player;
+
+typedef struct PlayerHud
+{
+    Rectangle healthBar;
+    Rectangle backgroundBar;
+    float maxHealth;
+    
+    Vector2 dollarsPosition;
+    int fontSize;
+    Color moneyColor;
+} PlayerHud;
+
+// Components an entity can carry, each archetype stores a fixed subset of them.
+// Only per-instance state lives here, anything shared by a type is read from the type tables.
+typedef enum
+{
+    COMPONENT_POSITION,     // Vector2
+    COMPONENT_DIRECTION,    // Vector2
+    COMPONENT_VELOCITY,     // Vector2, units per second
+    COMPONENT_HEALTH,       // int
+    COMPONENT_LIFE,         // float, seconds left
+    COMPONENT_ENEMY,        // Tag, archetype type indexes enemyTypes
+    COMPONENT_BULLET,       // Tag, archetype type indexes bulletTypes
+    COMPONENT_PARTICLE,     // Tag, archetype type indexes enemyTypes for the color of the enemy that threw it
+    COMPONENT_COUNT
+} ComponentId;
+
+#define COMPONENT_BIT(c) (1u << (c))
+
+#define ENEMY_COMPONENTS (COMPONENT_BIT (COMPONENT_ENEMY) | COMPONENT_BIT (COMPONENT_POSITION) | COMPONENT_BIT (COMPONENT_DIRECTION) | COMPONENT_BIT (COMPONENT_HEALTH))
+#define BULLET_COMPONENTS (COMPONENT_BIT (COMPONENT_BULLET) | COMPONENT_BIT (COMPONENT_POSITION) | COMPONENT_BIT (COMPONENT_DIRECTION))
+#define PARTICLE_COMPONENTS (COMPONENT_BIT (COMPONENT_PARTICLE) | COMPONENT_BIT (COMPONENT_POSITION) | COMPONENT_BIT (COMPONENT_VELOCITY) | COMPONENT_BIT (COMPONENT_LIFE))
+
+// Stats shared by every enemy of a type
+typedef struct EnemyTypeDef
+{
+    float speed;
+    int health;
+    int bounty;
+    float width;
+    float height;
+    Color color;
+} EnemyTypeDef;
+
+// Stats shared by every bullet of a type
+typedef struct BulletTypeDef
+{
+    float speed;
+    float radius;
+    int damage;
+    Color color;
+} BulletTypeDef;
+
+// A weapon fires bullets of one type, the type sets their speed and damage
+typedef struct WeaponDef
+{
+    const char *name;
+    BulletType bullet;
+    float fireRate;         // Shots per second
+    int projectiles;        // Bullets per shot
+    float spread;           // Angle the bullets of one shot fan out over, radians
+    float jitter;           // Random angle added to each bullet, radians
+    bool automatic;         // Keeps firing while the button is held
+} WeaponDef;
+
+// Reference to an entity: slot in the low 16 bits, slot generation in the high 16 bits.
+// A handle goes stale as soon as its entity dies, even if the slot is handed out again.
+typedef uint32_t EntityHandle;
+
+#define HANDLE_NONE 0           // Generation 0 is never issued, so no live entity ever has this handle
+#define HANDLE_SLOT_BITS 16
+#define HANDLE_SLOT_MASK 0xFFFF
+#define MAX_HANDLE_SLOTS (HANDLE_SLOT_MASK + 1)
+
+_Static_assert (MAX_ENTITIES <= MAX_HANDLE_SLOTS, "Too many entities for 16-bit handle slots");
+
+// One entity handle slot, the pool hands out the lowest free slots first
+typedef struct HandleSlot
+{
+    int location;           // Location of the entity owning the slot, -1 when free
+    uint16_t generation;    // Current generation of the slot
+} HandleSlot;
+
+DEFINE_POOL (HandleSlot, MAX_ENTITIES)
+
+// Fixed-size block holding up to archetype->capacity entities, one packed array per component
+typedef struct Chunk
+{
+    int archetype;
+    int count;
+    unsigned char *data;
+} Chunk;
+
+DEFINE_POOL (Chunk, MAX_CHUNKS)
+
+// All entities with exactly the same component set and type. Every chunk is full except the last one.
+// Keeping the type in the key means a chunk never mixes types, so systems look a type up once per chunk.
+typedef struct Archetype
+{
+    uint32_t mask;
+    int type;
+    int capacity;                       // Entities per chunk
+    int offset[COMPONENT_COUNT];        // Byte offset of each component array inside a chunk, -1 if absent
+    int handleOffset;                   // Byte offset of the handle array inside a chunk
+    int chunks[MAX_CHUNKS];
+    int chunkCount;
+    int count;
+} Archetype;
+
+typedef struct World
+{
+    Archetype archetypes[MAX_ARCHETYPES];
+    int archetypeCount;
+
+    ChunkPool chunks;
+    _Alignas (16) unsigned char chunkData[MAX_CHUNKS][CHUNK_BYTES];
+
+    HandleSlotPool handles;             // Slot locations are (chunk << 16) | row
+
+    EntityHandle pendingDestroy[MAX_ENTITIES];
+    int pendingCount;
+} World;
+
+// Iteration state of a query, walks every chunk of every archetype that has the requested components
+typedef struct Query
+{
+    uint32_t mask;
+    int archetype;
+    int chunk;
+} Query;
+
+// One chunk handed out by a query, arrays hold count entries
+typedef struct ChunkView
+{
+    int count;
+    int type;
+    void *component[COMPONENT_COUNT];
+    EntityHandle *handle;
+} ChunkView;
+
+// Named area of the sprite atlas, in pixels
+typedef struct AtlasSprite
+{
+    char name[ATLAS_NAME_BYTES];
+    Rectangle source;
+} AtlasSprite;
+
+// Every sprite and UI image packed into one texture, so consecutive draws never switch textures
+typedef struct SpriteAtlas
+{
+    Texture2D texture;
+    AtlasSprite sprites[ATLAS_MAX_SPRITES];
+    int count;
+} SpriteAtlas;
+
+// Asset pack layout: a PackHeader, entryCount PackEntry records, then the payloads at PACK_ALIGN boundaries.
+// Images are stored in the pixel format the GPU takes, so loading them is a mapping and an upload.
+typedef struct PackHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t reserved;
+} PackHeader;
+
+typedef enum PackEntryKind { PACK_ENTRY_IMAGE, PACK_ENTRY_TEXT } PackEntryKind;
+
+typedef struct PackEntry
+{
+    char name[PACK_NAME_BYTES];
+    uint32_t kind;
+    uint32_t width;         // Images only
+    uint32_t height;
+    uint32_t format;        // PixelFormat
+    uint64_t offset;        // From the start of the file
+    uint64_t size;          // Payload bytes, text includes its terminator
+} PackEntry;
+
+// An opened pack, payloads are read in place and stay valid until CloseAssetPack
+typedef struct AssetPack
+{
+    unsigned char *data;
+    size_t size;
+    bool mapped;            // mmap on POSIX, read into memory elsewhere
+    const PackEntry *entries;
+    int count;
+} AssetPack;
+
+// One atlas (and optionally the window icon) decoded on worker threads and uploaded by the main thread
+typedef struct AssetLoader
+{
+    AtlasGroup group;
+    bool withIcon;                          // Job 0 decodes the window icon
+
+    // Decoding, shared with the workers
+    pthread_t workers[LOADER_WORKERS];
+    int workerCount;
+    const char *paths[LOADER_MAX_JOBS];
+    const char *names[LOADER_MAX_JOBS];     // Sprite names of loose atlas inputs
+    Image images[LOADER_MAX_JOBS];
+    int jobCount;
+    bool fromAtlasFiles;                    // The jobs decode the packed atlas instead of the loose images
+    char atlasPath[LOADER_PATH_BYTES];      // Without extension
+    char atlasImagePath[LOADER_PATH_BYTES];
+    atomic_int nextJob;
+    atomic_int finishedJobs;
+    atomic_bool decoded;                    // Set once the results below are complete
+
+    // Results, only touched by the main thread after decoded
+    AssetPack pack;
+    bool packed;
+    Image icon;
+    Image atlasImage;
+    SpriteAtlas atlas;
+
+    // Upload, a slice of rows per frame
+    int uploadedRows;
+    bool finished;
+} AssetLoader;
+
+// Atlases currently resident or on their way, by group
+typedef struct GameResources
+{
+    AssetLoader loaders[ATLAS_GROUP_COUNT];
+    bool loading[ATLAS_GROUP_COUNT];
+    SpriteAtlas atlas[ATLAS_GROUP_COUNT];   // Empty texture when not resident
+    const char *packPath;                   // NULL loads the loose images
+    bool iconRequested;
+} GameResources;
+
+// Quads collected during a frame and drawn from one vertex buffer with a single texture
+typedef struct SpriteBatch
+{
+    Mesh mesh;              // Dynamic vertex buffer, refilled every frame
+    Material material;      // Default shader with the sprite atlas bound
+    Texture2D defaultTexture;   // Put back before unloading, the atlas belongs to the caller
+    int capacity;           // Quads per draw call
+    int count;              // Quads waiting to be drawn
+    int drawCalls;          // Draw calls issued this frame
+    int vertices;           // Vertices submitted this frame
+    int peakDrawCalls;      // Highest per-frame counts seen, logged on exit
+    int peakVertices;
+} SpriteBatch;
+
+// Bounds and draw information of one entity, copied into the grid when it is built
+typedef struct GridEntry
+{
+    Rectangle bounds;
+    int cellX;
+    int cellY;
+    unsigned char kind;     // COMPONENT_ENEMY, COMPONENT_BULLET or COMPONENT_PARTICLE
+    unsigned char type;
+    unsigned char alpha;    // Sparks fade out, everything else is opaque
+} GridEntry;
+
+// Hashed uniform grid over the whole world, rebuilt every tick
+typedef struct SpatialGrid
+{
+    int bucketStart[GRID_BUCKETS + 1];  // Entries of bucket b are entries[bucketStart[b]..bucketStart[b + 1])
+    GridEntry entries[MAX_ENTITIES];
+    GridEntry unsorted[MAX_ENTITIES];
+    int count;
+} SpatialGrid;
+
+// Result of culling the grid against the camera, indices into grid->entries
+typedef struct VisibleSet
+{
+    int index[MAX_ENTITIES];
+    int count;
+    int culled;
+} VisibleSet;
+
+// Command line options
+typedef struct GameConfig
+{
+    int renderHeight;       // --render-height: internal resolution height, 0 renders at native resolution
+    bool dynamicResolution; // --dynamic-resolution MIN MAX: scale the internal resolution with the frame time
+    float minRenderScale;   // Bounds as a fraction of the display resolution
+    float maxRenderScale;
+    const char *packAtlas;  // --pack-atlas: write the sprite atlases next to this path and exit
+    const char *buildPack;  // --build-pack: write the asset pack to this path and exit
+    const char *packPath;   // --pack: asset pack to load, the one --build-pack writes by default
+    bool noPack;            // --no-pack: ignore the asset pack and load the loose images
+    bool idleAware;         // Off with --always-redraw: throttle static screens and pause when unfocused
+    bool simThread;         // Off with --no-sim-thread: run gameplay ticks on the main thread
+    bool latencyProbe;      // --latency-probe: time clicks until they are on screen, report a histogram on exit
+    PacingMode pacing;      // --pacing vsync|lowlatency|uncapped
+    bool poisonArena;       // --poison-arena: fill frame arena memory once the frame is over
+    int soakMinutes;        // --soak MINUTES: a bot plays for this much game time, one CSV row per minute
+    const char *soakPath;   // --soak-csv: where the rows go
+    int benchFrames;        // --bench FRAMES: draw a frozen wave this many frames, log the batch counts and exit
+    int benchWave;          // --bench-wave ROW: row of the wave table the bench spawns
+} GameConfig;
+
+// Draws the game at a fixed internal resolution and scales it up to the screen.
+// Game code keeps working in logical coordinates (the screen size), the UI camera maps them to the target.
+typedef struct GameViewport
+{
+    bool enabled;
+    RenderTexture2D target; // Allocated at the largest internal resolution, smaller ones use its top-left corner
+    int width;              // Internal resolution
+    int height;
+    float scale;            // Internal pixels per logical pixel
+    float logicalWidth;
+    float logicalHeight;
+    Camera2D uiCamera;      // Logical coordinates to internal pixels
+    Rectangle dest;         // Where the internal image lands on the screen
+} GameViewport;
+
+// Render texture redrawn only when the values it shows change, then composited with one quad.
+// Any HUD widget can use one: pass the values it depends on as the key.
+typedef struct CachedLayer
+{
+    RenderTexture2D target;
+    Rectangle bounds;                       // Logical screen area covered by the layer
+    unsigned char key[LAYER_KEY_BYTES];     // Values the layer was last drawn with
+    int keySize;
+    bool valid;
+    int redraws;
+} CachedLayer;
+
+// Everything the player HUD shows
+typedef struct HudValues
+{
+    int health;
+    int maxHealth;
+    int dollars;
+    int weapon;
+} HudValues;
+
+_Static_assert (sizeof (HudValues) <= LAYER_KEY_BYTES, "HUD key does not fit in a cached layer");
+
+// One glyph of a laid out string, relative to the string origin
+typedef struct GlyphQuad
+{
+    Rectangle source;       // Font atlas area
+    Rectangle dest;
+} GlyphQuad;
+
+// A string laid out once for a (font, size) pair
+typedef struct TextRun
+{
+    char text[TEXT_RUN_BYTES];
+    unsigned int fontId;    // Font texture id
+    int fontSize;
+    uint32_t hash;
+    float width;            // Same as MeasureText
+    GlyphQuad quads[TEXT_RUN_GLYPHS];
+    int quadCount;          // Spaces produce no quad
+    unsigned int lastUsed;
+    bool used;
+} TextRun;
+
+// Scratch memory for one frame: bumped out of one block, all of it handed back at the top of the next frame
+typedef struct FrameArena
+{
+    unsigned char *base;
+    size_t capacity;
+    size_t used;
+    size_t peak;            // Most any frame used since startup
+    int failed;             // Allocations that did not fit
+    bool poison;            // Released memory is filled with ARENA_POISON, so reading it after the frame shows
+} FrameArena;
+
+// Measured widths and glyph quads of recently drawn strings, least recently used run is replaced on a miss.
+// A changed string is a different key, so nothing has to be invalidated by hand.
+typedef struct TextCache
+{
+    TextRun runs[TEXT_CACHE_RUNS];
+    unsigned int clock;
+    int hits;
+    int misses;
+} TextCache;
+
+// A click, stamped with when it happened rather than with the frame that noticed it
+typedef struct InputEvent
+{
+    double time;            // GetTime clock, when the poll that read it delivered it
+    Vector2 position;       // Logical screen coordinates
+} InputEvent;
+
+// Raylib only keeps the latest button state, a press and release between two polls leave no pressed edge.
+// Clicks are queued from GLFW's mouse button callback instead, one per press, and stay in order until
+// the simulation takes them.
+typedef struct InputQueue
+{
+    InputEvent events[INPUT_QUEUE_SIZE];
+    int head;
+    int count;
+    int dropped;            // Clicks lost to a full queue
+    const GameViewport *viewport;   // Maps the cursor to logical screen coordinates
+    unsigned int keys;      // Watched keys pressed at any poll since ResetInputFrame
+    bool clicked;           // Any left button press since ResetInputFrame
+} InputQueue;
+
+// A click waiting for the first frame that shows the tick which consumed it
+typedef struct LatencySample
+{
+    double time;
+    unsigned int tick;
+} LatencySample;
+
+// Time from a click to EndDrawing returning on the first frame drawn from a tick that consumed it.
+// Raylib gives no present timestamps, EndDrawing returning after the swap is the closest we can see.
+typedef struct LatencyProbe
+{
+    bool enabled;
+    LatencySample pending[LATENCY_PENDING];
+    int pendingCount;
+    int bins[LATENCY_BINS + 1];             // 1 ms each, the last one holds everything slower
+    int count;
+    double total;
+    double worst;
+} LatencyProbe;
+
+// One minute of a soak run
+typedef struct SoakSample
+{
+    int minute;
+    double wallTime;        // Seconds since the run started
+    size_t resident;        // Bytes, 0 where the platform does not tell
+    size_t heapUsed;
+    size_t heapTotal;
+    int enemies;
+    int bullets;
+    int particlePeak;       // Most sparks alive at once since the run started
+    float frameP50;         // Milliseconds
+    float frameP99;
+    float frameMax;
+} SoakSample;
+
+// A bot plays whole games back to back on a fixed time step, so a minute is always 3600 frames however
+// fast they run. Pair with --pacing uncapped to run faster than real time.
+typedef struct SoakTest
+{
+    bool enabled;
+    int minutes;            // Game minutes to run
+    FILE *csv;
+    double start;
+    float clock;            // Game seconds into the current minute
+    float gameClock;        // Game seconds into the current game
+    float botTime;
+    int frameBins[SOAK_FRAME_BINS + 1];     // 0.1 ms each over the current minute, the last one holds the rest
+    int frameCount;
+    float frameMax;
+    int particlePeak;
+    SoakSample samples[SOAK_MAX_SAMPLES];   // For the trend summary, the CSV gets every minute
+    int sampleCount;
+    int sampleStride;       // Minutes between kept samples, doubles each time the array fills up
+    int minute;
+} SoakTest;
+
+// Draws one wave of the table, spawned all at once and frozen, for a fixed number of frames. The scene is the
+// same every frame, so the batch counts are exact and a CI job can check them under a software GL driver:
+//     xvfb-run -a env LIBGL_ALWAYS_SOFTWARE=1 ./game --bench 300 --pacing uncapped
+// The exit status is 1 if any frame drew its quads in more calls than the batch capacity makes necessary, or
+// if the last frame, read back from the GPU, does not show the enemies in their colors where they should be.
+typedef struct BenchRun
+{
+    bool enabled;
+    int frames;             // Gameplay frames to draw
+    int wave;
+    int measured;           // Gameplay frames drawn so far
+    int quads;              // Sprites pushed in the last frame
+    long long drawCalls;    // Totals over the measured frames
+    long long vertices;
+    int mismatches;         // Frames whose draw calls or vertices did not match the quads pushed
+    double frameTime;
+    int pixelsChecked;      // Enemy centers sampled on the last frame
+    int pixelsWrong;
+} BenchRun;
+
+// Frame rate policy per state, applied once per frame
+typedef struct FramePacer
+{
+    bool idleAware;
+    PacingMode mode;
+    int targetFps;          // Currently applied target
+    bool waitingEvents;     // EndDrawing sleeps until the next input event
+
+    // Low latency pacing
+    float refreshInterval;  // Seconds between vblanks
+    double presented;       // When EndDrawing last returned, right after a vblank
+    double workStart;       // When this frame sampled its input
+    float work[PACING_WINDOW];  // Input sampling to EndDrawing, recent frames
+    int workIndex;
+    float predicted;        // Expected cost of the next frame
+} FramePacer;
+
+// Picks the internal resolution from recent frame times
+typedef struct DynamicResolution
+{
+    bool enabled;
+    float minScale;
+    float maxScale;
+    float scale;            // Fraction of the display resolution drawn this frame
+    float budget;           // Target frame time in seconds
+    float history[FRAME_HISTORY];
+    int historyIndex;
+    int historyCount;
+    float cooldown;         // Seconds until the scale may change again
+    float failedScale;      // Last scale that missed the budget
+    float failedTimer;      // Seconds until failedScale may be probed again
+} DynamicResolution;
+
+// One row of the wave table
+typedef struct WaveDef
+{
+    int count;          // Enemies spawned by this wave
+    EnemyType type;
+    float ringMin;      // Spawn ring around the player (inner radius)
+    float ringMax;      // Spawn ring around the player (outer radius)
+    float interval;     // Seconds between spawns, 0 spawns the whole wave at once
+    float delay;        // Pause before the wave starts
+} WaveDef;
+
+typedef struct WaveSpawner
+{
+    int wave;           // Current row of the wave table
+    int spawned;        // Enemies spawned so far in the current wave
+    float timer;        // Time owed to the next spawn
+    int dropped;        // Spawns skipped because the pool was full
+} WaveSpawner;
+
+// Part of the frame an allocation is charged to, per thread. Worker threads and startup stay in OTHER.
+typedef enum
+{
+    ALLOC_PHASE_OTHER,
+    ALLOC_PHASE_INPUT,
+    ALLOC_PHASE_UPDATE,
+    ALLOC_PHASE_SIM,
+    ALLOC_PHASE_DRAW,
+    ALLOC_PHASE_PRESENT,
+    ALLOC_PHASE_COUNT
+} AllocPhase;
+
+#if defined(TRACK_ALLOCATIONS)
+
+// Allocations made from one return address
+typedef struct AllocSite
+{
+    atomic_uintptr_t address;
+    atomic_int count;
+    atomic_size_t bytes;
+} AllocSite;
+
+// Written from any thread inside malloc, so everything is atomic and nothing here may allocate
+typedef struct AllocStats
+{
+    atomic_int count[ALLOC_PHASE_COUNT];
+    atomic_size_t bytes[ALLOC_PHASE_COUNT];
+    atomic_int frameCount[ALLOC_PHASE_COUNT];   // Since the last EndAllocFrame
+    atomic_int frees;
+    AllocSite sites[ALLOC_SITES];               // Open addressing on the return address, full means uncounted
+    int frames;                                 // Checked gameplay frames, and how many of them allocated
+    int allocatingFrames;
+} AllocStats;
+
+#define SET_ALLOC_PHASE(phase) (allocPhase = (phase))
+
+#else
+
+#define SET_ALLOC_PHASE(phase) ((void)0)
+
+#endif
+
+// Everything one simulation tick needs from the main thread, sampled there because raylib input is not thread safe
+typedef struct SimInput
+{
+    float dt;
+    int clickCount;
+    Vector2 clickAim[SIM_MAX_CLICKS];       // World position clicked
+    float clickAge[SIM_MAX_CLICKS];         // Seconds between the click and the end of the tick, at most dt
+    bool triggerHeld;                       // Left button down when the tick was sampled
+    Vector2 aim;                            // World position under the mouse at that time
+    int weapon;                             // Weapon to switch to, -1 to keep the current one
+    Vector2 move;                           // -1, 0 or 1 per axis
+} SimInput;
+
+// A visible bullet, enemy or spark as the renderer needs it
+typedef struct SnapshotSprite
+{
+    Rectangle bounds;
+    unsigned char kind;     // COMPONENT_ENEMY, COMPONENT_BULLET or COMPONENT_PARTICLE
+    unsigned char type;
+    unsigned char alpha;
+} SnapshotSprite;
+
+// The result of one tick. The render thread only reads it, the sim thread never writes a slot being read.
+typedef struct FrameSnapshot
+{
+    unsigned int tick;
+    SnapshotSprite sprites[MAX_ENTITIES];   // Already culled against the view
+    int spriteCount;
+    int culled;
+    Rectangle player;
+    HudValues hud;
+    int enemies;
+    int bullets;
+    int particles;
+    int droppedShots;
+    bool playerDead;
+    float tickTime;                         // Seconds the tick took
+} FrameSnapshot;
+
+// Runs gameplay ticks on its own thread. Inputs come in through a short locked queue, results go out
+// through a lock-free triple buffer of snapshots.
+typedef struct Simulation
+{
+    // Gameplay state, only touched by the main thread while the simulation is idle
+    Player *player;
+    World *world;
+    WaveSpawner *spawner;
+    SpatialGrid *grid;
+    VisibleSet *visible;
+    float screenWidth;                      // Bullets leaving the screen are destroyed
+    float screenHeight;
+    Vector2 minBounds;                      // Player position limits
+    Vector2 maxBounds;
+    Rectangle view;                         // Culling rectangle
+    unsigned int tick;
+    unsigned int posted;                    // Ticks handed over so far, main thread only. Tick n publishes snapshot n.
+
+    // Input queue, main thread to sim thread
+    pthread_t thread;
+    bool threaded;                          // Ticks run inline on the main thread otherwise
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                    // Input arrived or quit
+    pthread_cond_t done;                    // A tick finished
+    SimInput inputs[SIM_QUEUE_DEPTH];
+    int head;
+    int pending;
+    bool busy;
+    bool quit;
+
+    // Snapshots, sim thread to main thread
+    FrameSnapshot slots[SNAPSHOT_SLOTS];
+    atomic_uint middle;                     // Slot handed over last, SNAPSHOT_FRESH while nobody took it
+    unsigned int writing;                   // Owned by whoever produces
+    unsigned int reading;                   // Owned by the render thread
+} Simulation;
+
+// What the state hooks work on
+typedef struct GameSession
+{
+    Player *player;
+    Vector2 spawnPoint;
+    World *world;
+    WaveSpawner *spawner;
+    Simulation *sim;
+    InputQueue *input;
+    int benchWave;          // Spawned whole when gameplay starts, -1 outside --bench
+} GameSession;
+
+// Per-state resources and hooks, indexed by GameState
+typedef struct StateDef
+{
+    const char *name;
+    unsigned int needs;                     // Atlas groups resident before the state draws its first frame
+    unsigned int prefetch;                  // Loaded in the background for the states that usually follow
+    void (*enter) (GameSession *session);
+    void (*exit) (GameSession *session);
+} StateDef;
+
+typedef struct StateMachine
+{
+    GameState current;
+    GameState target;                       // Entered from STATE_LOADING once its resources are in
+} StateMachine;
+
+
+typedef struct MenuButton
+{
+    Rectangle rect;
+    const char *text;
+    int fontSize;
+    int textWidth;
+    bool isHovered;
+    Color buttonColor;
+} MenuButton;
+
+static const EnemyTypeDef enemyTypes[ENEMY_TYPE_COUNT] =
+{
+    [ENEMY_GRUNT]  = { 50.0f, 100, 10, ENEMY_WIDTH, ENEMY_HEIGHT, RED },
+    [ENEMY_RUNNER] = { 120.0f, 100, 15, ENEMY_WIDTH, ENEMY_HEIGHT, ORANGE },
+    [ENEMY_BRUTE]  = { 30.0f, 300, 40, ENEMY_WIDTH, ENEMY_HEIGHT, MAROON },
+};
+
+static const BulletTypeDef bulletTypes[BULLET_TYPE_COUNT] =
+{
+    [BULLET_STANDARD] = { 600.0f, BULLET_RADIUS, 100, BLACK },
+    [BULLET_PELLET]   = { 700.0f, 3.0f, 35, DARKGRAY },
+    [BULLET_ROUND]    = { 900.0f, 3.0f, 30, DARKBROWN },
+};
+
+// The minigun fires faster than the frame rate, the shotgun puts many bullets out at once
+static const WeaponDef weapons[WEAPON_COUNT] =
+{
+    [WEAPON_PISTOL]  = { "Pistol",  BULLET_STANDARD, 15.0f, 1, 0.0f, 0.0f, false },
+    [WEAPON_SHOTGUN] = { "Shotgun", BULLET_PELLET, 1.5f, 9, 0.6f, 0.05f, false },
+    [WEAPON_MINIGUN] = { "Minigun", BULLET_ROUND, 90.0f, 1, 0.0f, 0.12f, true },
+};
+
+static const char *pacingModeNames[PACING_MODE_COUNT] = { "vsync", "lowlatency", "uncapped" };
+
+// The last rows are stress waves meant to saturate the simulation
+static const WaveDef waves[] =
+{
+    { 5,     ENEMY_GRUNT,  500.0f, 700.0f, 0.5f,    1.0f },
+    { 20,    ENEMY_GRUNT,  500.0f, 800.0f, 0.25f,   3.0f },
+    { 30,    ENEMY_RUNNER, 600.0f, 900.0f, 0.1f,    3.0f },
+    { 10,    ENEMY_BRUTE,  600.0f, 900.0f, 0.5f,    2.0f },
+    { 2000,  ENEMY_GRUNT,  700.0f, 1200.0f, 0.005f, 5.0f },
+    { 10000, ENEMY_RUNNER, 800.0f, 1600.0f, 0.0005f, 5.0f },
+    { 30000, ENEMY_GRUNT,  900.0f, 2000.0f, 0.0f,   5.0f },
+};
+
+#define WAVE_COUNT (int)(sizeof (waves) / sizeof (waves[0]))
+
+// Game configuration
+
+static GameConfig ParseGameConfig (int argc, char *argv[])
+{
+    GameConfig config = { 0 };
+    config.minRenderScale = 0.5f;
+    config.maxRenderScale = 1.0f;
+    config.idleAware = true;
+    config.simThread = true;
+    config.soakPath = SOAK_PATH;
+    config.packPath = PACK_PATH;
+    config.benchWave = BENCH_WAVE;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp (argv[i], "--render-height") == 0 && i + 1 < argc) config.renderHeight = atoi (argv[++i]);
+        else if (strcmp (argv[i], "--always-redraw") == 0) config.idleAware = false;
+        else if (strcmp (argv[i], "--pack-atlas") == 0) config.packAtlas = (i + 1 < argc) ? argv[++i] : ATLAS_PATH;
+        else if (strcmp (argv[i], "--build-pack") == 0) config.buildPack = (i + 1 < argc) ? argv[++i] : PACK_PATH;
+        else if (strcmp (argv[i], "--pack") == 0 && i + 1 < argc) config.packPath = argv[++i];
+        else if (strcmp (argv[i], "--no-pack") == 0) config.noPack = true;
+        else if (strcmp (argv[i], "--no-sim-thread") == 0) config.simThread = false;
+        else if (strcmp (argv[i], "--latency-probe") == 0) config.latencyProbe = true;
+        else if (strcmp (argv[i], "--poison-arena") == 0) config.poisonArena = true;
+        else if (strcmp (argv[i], "--soak") == 0 && i + 1 < argc) config.soakMinutes = atoi (argv[++i]);
+        else if (strcmp (argv[i], "--soak-csv") == 0 && i + 1 < argc) config.soakPath = argv[++i];
+        else if (strcmp (argv[i], "--bench") == 0 && i + 1 < argc) config.benchFrames = atoi (argv[++i]);
+        else if (strcmp (argv[i], "--bench-wave") == 0 && i + 1 < argc) config.benchWave = atoi (argv[++i]);
+        else if (strcmp (argv[i], "--pacing") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            bool found = false;
+
+            for (int mode = 0; mode < PACING_MODE_COUNT; mode++)
+            {
+                if (strcmp (name, pacingModeNames[mode]) == 0)
+                {
+                    config.pacing = mode;
+                    found = true;
+                }
+            }
+
+            if (!found) TraceLog (LOG_WARNING, "CONFIG: Unknown pacing mode %s, using %s", name, pacingModeNames[config.pacing]);
+        }
+        else if (strcmp (argv[i], "--dynamic-resolution") == 0 && i + 2 < argc)
+        {
+            config.dynamicResolution = true;
+            config.minRenderScale = Clamp ((float)atof (argv[++i]), 0.1f, 1.0f);
+            config.maxRenderScale = Clamp ((float)atof (argv[++i]), config.minRenderScale, 2.0f);
+        }
+        else TraceLog (LOG_WARNING, "CONFIG: Unknown option %s", argv[i]);
+    }
+
+    // The bot and the bench need every frame, a throttled or event-waiting screen would stall them
+    if (config.soakMinutes > 0 || config.benchFrames > 0) config.idleAware = false;
+
+    if (config.benchWave < 0 || config.benchWave >= WAVE_COUNT)
+    {
+        TraceLog (LOG_WARNING, "CONFIG: No wave %d, the bench uses wave %d", config.benchWave, BENCH_WAVE);
+        config.benchWave = BENCH_WAVE;
+    }
+
+    return config;
+}
+
+// Seconds on a clock that already runs before the window exists
+static double GetWallTime (void)
+{
+    struct timespec now;
+    timespec_get (&now, TIME_UTC);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+// Internal resolution
+
+// Changes the internal resolution, never above the one the target was allocated with
+static void SetViewportHeight (GameViewport *viewport, int height)
+{
+    if (viewport->enabled && height > viewport->target.texture.height) height = viewport->target.texture.height;
+
+    viewport->height = height;
+    viewport->width = (int)(height * viewport->logicalWidth / viewport->logicalHeight + 0.5f);
+    viewport->scale = height / viewport->logicalHeight;
+    viewport->uiCamera = (Camera2D){ .zoom = viewport->scale };
+}
+
+// renderHeight <= 0 draws straight to the screen
+static void InitGameViewport (GameViewport *viewport, float logicalWidth, float logicalHeight, int renderHeight)
+{
+    viewport->enabled = renderHeight > 0;
+    viewport->logicalWidth = logicalWidth;
+    viewport->logicalHeight = logicalHeight;
+    viewport->target = (RenderTexture2D){ 0 };
+
+    if (viewport->enabled)
+    {
+        int width = (int)(renderHeight * logicalWidth / logicalHeight + 0.5f);
+        viewport->target = LoadRenderTexture (width, renderHeight);
+        SetTextureFilter (viewport->target.texture, TEXTURE_FILTER_BILINEAR);
+    }
+
+    SetViewportHeight (viewport, viewport->enabled ? renderHeight : (int)logicalHeight);
+
+    // Fit the internal image on the screen keeping its aspect ratio
+    float screenWidth = GetScreenWidth ();
+    float screenHeight = GetScreenHeight ();
+    float fit = fminf (screenWidth / viewport->width, screenHeight / viewport->height);
+    viewport->dest.width = viewport->width * fit;
+    viewport->dest.height = viewport->height * fit;
+    viewport->dest.x = (screenWidth - viewport->dest.width) / 2.0f;
+    viewport->dest.y = (screenHeight - viewport->dest.height) / 2.0f;
+
+    if (viewport->enabled) TraceLog (LOG_INFO, "VIEWPORT: Rendering at up to %ix%i, upscaled to %ix%i", viewport->width, viewport->height, (int)viewport->dest.width, (int)viewport->dest.height);
+}
+
+static void UnloadGameViewport (GameViewport *viewport)
+{
+    if (viewport->enabled) UnloadRenderTexture (viewport->target);
+}
+
+// Everything drawn until EndGameViewport goes to the internal resolution target
+static void BeginGameViewport (GameViewport *viewport)
+{
+    if (viewport->enabled) BeginTextureMode (viewport->target);
+}
+
+// Stretches the internal image over the screen
+static void EndGameViewport (GameViewport *viewport)
+{
+    if (!viewport->enabled) return;
+
+    EndTextureMode ();
+
+    // Render textures are stored upside down
+    Rectangle source = { 0.0f, (float)(viewport->target.texture.height - viewport->height), (float)viewport->width, -(float)viewport->height };
+
+    ClearBackground (BLACK);
+    DrawTexturePro (viewport->target.texture, source, viewport->dest, (Vector2){ 0.0f, 0.0f }, 0.0f, WHITE);
+}
+
+// World camera as seen through the internal resolution
+static Camera2D GetViewportCamera (const GameViewport *viewport, Camera2D camera)
+{
+    camera.offset = Vector2Scale (camera.offset, viewport->scale);
+    camera.zoom *= viewport->scale;
+
+    return camera;
+}
+
+// Mouse position in logical screen coordinates, feed it to GetScreenToWorld2D for world coordinates
+static Vector2 GetViewportMouse (const GameViewport *viewport)
+{
+    Vector2 mouse = GetMousePosition ();
+
+    if (!viewport->enabled) return mouse;
+
+    return (Vector2){
+        (mouse.x - viewport->dest.x) / viewport->dest.width * viewport->logicalWidth,
+        (mouse.y - viewport->dest.y) / viewport->dest.height * viewport->logicalHeight
+    };
+}
+
+// Dynamic resolution
+
+static void InitDynamicResolution (DynamicResolution *drs, bool enabled, float minScale, float maxScale, float budget)
+{
+    *drs = (DynamicResolution){ 0 };
+    drs->enabled = enabled;
+    drs->minScale = minScale;
+    drs->maxScale = maxScale;
+    drs->scale = maxScale;
+    drs->budget = budget;
+}
+
+// Records how long the last frame took to render and returns the render scale to use for the next frame.
+// Raylib exposes no GPU timer queries, so BeginDrawing to EndDrawing returning stands in for the GPU time:
+// it holds the draw calls and the swap, but not the wait for the sim thread. frameTime runs the timers.
+static float UpdateDynamicResolution (DynamicResolution *drs, float frameTime, float renderTime)
+{
+    drs->history[drs->historyIndex] = renderTime;
+    drs->historyIndex = (drs->historyIndex + 1) % FRAME_HISTORY;
+    if (drs->historyCount < FRAME_HISTORY) drs->historyCount++;
+
+    drs->cooldown -= frameTime;
+    drs->failedTimer -= frameTime;
+
+    if (!drs->enabled || drs->cooldown > 0.0f || drs->historyCount < DRS_WINDOW) return drs->scale;
+
+    // Look at the most recent frames only
+    int slow = 0;
+    float worst = 0.0f;
+    for (int i = 1; i <= DRS_WINDOW; i++)
+    {
+        float t = drs->history[(drs->historyIndex - i + FRAME_HISTORY) % FRAME_HISTORY];
+        if (t > drs->budget*1.05f) slow++;
+        if (t > worst) worst = t;
+    }
+
+    if (slow >= DRS_WINDOW/10)
+    {
+        // Pixel cost grows with the square of the scale
+        float step = fmaxf (sqrtf (drs->budget / worst), 0.75f);
+        drs->failedScale = drs->scale;
+        drs->failedTimer = 10.0f;
+        drs->scale = fmaxf (drs->scale * fminf (step, 0.95f), drs->minScale);
+        drs->cooldown = 0.5f;
+    }
+    else if (worst < drs->budget*1.05f && drs->scale < drs->maxScale)
+    {
+        // Only probe back up to the scale that last missed the budget once it has had time to settle
+        float next = fminf (drs->scale + 0.05f, drs->maxScale);
+        if (drs->failedTimer <= 0.0f || next < drs->failedScale) drs->scale = next;
+        drs->cooldown = 1.0f;
+    }
+
+    return drs->scale;
+}
+
+// Render time graph for the debug overlay, the line marks the frame budget
+static void DrawFrameTimeGraph (const DynamicResolution *drs, int x, int y, int height)
+{
+    float pixelsPerSecond = height / (drs->budget*2.0f);
+
+    DrawRectangle (x, y, FRAME_HISTORY*2, height, Fade (LIGHTGRAY, 0.5f));
+
+    for (int i = 0; i < drs->historyCount; i++)
+    {
+        float t = drs->history[(drs->historyIndex - drs->historyCount + i + FRAME_HISTORY) % FRAME_HISTORY];
+        int barHeight = (int)fminf (t*pixelsPerSecond, (float)height);
+        DrawRectangle (x + i*2, y + height - barHeight, 2, barHeight, (t > drs->budget*1.05f) ? RED : DARKGREEN);
+    }
+
+    DrawRectangle (x, y + height/2, FRAME_HISTORY*2, 1, BLACK);
+}
+
+// Cached layers
+
+static void InitCachedLayer (CachedLayer *layer, Rectangle bounds)
+{
+    layer->target = LoadRenderTexture ((int)bounds.width, (int)bounds.height);
+    layer->bounds = bounds;
+    layer->keySize = 0;
+    layer->valid = false;
+    layer->redraws = 0;
+}
+
+static void UnloadCachedLayer (CachedLayer *layer)
+{
+    UnloadRenderTexture (layer->target);
+}
+
+// Returns false if the layer already shows these values. Otherwise starts redrawing it, draw in logical
+// screen coordinates and finish with EndCachedLayer. Must not be called inside another texture mode.
+static bool BeginCachedLayer (CachedLayer *layer, const void *values, int size)
+{
+    if (layer->valid && size == layer->keySize && memcmp (layer->key, values, size) == 0) return false;
+
+    memcpy (layer->key, values, size);
+    layer->keySize = size;
+    layer->valid = true;
+    layer->redraws++;
+
+    BeginTextureMode (layer->target);
+    ClearBackground (BLANK);
+    BeginMode2D ((Camera2D){ .target = { layer->bounds.x, layer->bounds.y }, .zoom = 1.0f });
+
+    return true;
+}
+
+static void EndCachedLayer (void)
+{
+    EndMode2D ();
+    EndTextureMode ();
+}
+
+// Composites the layer with one textured quad
+static void DrawCachedLayer (const CachedLayer *layer)
+{
+    Rectangle source = { 0.0f, 0.0f, (float)layer->target.texture.width, -(float)layer->target.texture.height };
+    DrawTexturePro (layer->target.texture, source, layer->bounds, (Vector2){ 0.0f, 0.0f }, 0.0f, WHITE);
+}
+
+// Allocation tracking
+
+#if defined(TRACK_ALLOCATIONS)
+
+static const char *allocPhaseNames[ALLOC_PHASE_COUNT] = { "other", "input", "update", "sim", "draw", "present" };
+
+static AllocStats allocStats;
+static _Thread_local AllocPhase allocPhase;
+
+// glibc's own entry points, the overrides below forward to them
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *pointer, size_t size);
+extern void __libc_free (void *pointer);
+
+static void RecordAllocation (size_t size, void *caller)
+{
+    AllocPhase phase = allocPhase;
+    atomic_fetch_add (&allocStats.count[phase], 1);
+    atomic_fetch_add (&allocStats.bytes[phase], size);
+    atomic_fetch_add (&allocStats.frameCount[phase], 1);
+
+    uintptr_t address = (uintptr_t)caller;
+
+    for (int i = 0; i < ALLOC_SITES; i++)
+    {
+        AllocSite *site = &allocStats.sites[(address / 16 + i) % ALLOC_SITES];
+        uintptr_t expected = 0;
+
+        if (atomic_load (&site->address) == address || atomic_compare_exchange_strong (&site->address, &expected, address) || expected == address)
+        {
+            atomic_fetch_add (&site->count, 1);
+            atomic_fetch_add (&site->bytes, size);
+            return;
+        }
+    }
+}
+
+// Replace the C library allocator for the whole process, raylib and the drivers included.
+// aligned_alloc and posix_memalign are not counted.
+void *malloc (size_t size)
+{
+    RecordAllocation (size, __builtin_return_address (0));
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t count, size_t size)
+{
+    RecordAllocation (count*size, __builtin_return_address (0));
+    return __libc_calloc (count, size);
+}
+
+void *realloc (void *pointer, size_t size)
+{
+    RecordAllocation (size, __builtin_return_address (0));
+    return __libc_realloc (pointer, size);
+}
+
+void free (void *pointer)
+{
+    if (pointer != NULL) atomic_fetch_add (&allocStats.frees, 1);
+    __libc_free (pointer);
+}
+
+// Once per frame after EndDrawing. A checked frame is a gameplay frame past warm-up, it should not allocate
+// in any loop phase. Returns how many allocations the loop made this frame.
+static int EndAllocFrame (bool checked)
+{
+    int counts[ALLOC_PHASE_COUNT];
+    int total = 0;
+
+    for (int phase = 0; phase < ALLOC_PHASE_COUNT; phase++)
+    {
+        counts[phase] = atomic_exchange (&allocStats.frameCount[phase], 0);
+        if (phase != ALLOC_PHASE_OTHER) total += counts[phase];
+    }
+
+    if (!checked) return total;
+
+    allocStats.frames++;
+    if (total == 0) return 0;
+
+    allocStats.allocatingFrames++;
+    TraceLog (LOG_WARNING, "ALLOC: Gameplay frame allocated %d times (input %d, update %d, sim %d, draw %d, present %d)",
+        total, counts[ALLOC_PHASE_INPUT], counts[ALLOC_PHASE_UPDATE], counts[ALLOC_PHASE_SIM], counts[ALLOC_PHASE_DRAW], counts[ALLOC_PHASE_PRESENT]);
+
+#if TRACK_ALLOCATIONS > 1
+    abort ();
+#endif
+
+    return total;
+}
+
+static void LogAllocReport (void)
+{
+    TraceLog (LOG_INFO, "ALLOC: %d of %d gameplay frames past warm-up allocated, %d frees overall", allocStats.allocatingFrames, allocStats.frames, atomic_load (&allocStats.frees));
+
+    for (int phase = 0; phase < ALLOC_PHASE_COUNT; phase++)
+    {
+        TraceLog (LOG_INFO, "ALLOC:   %-8s %8d allocations %12zu bytes", allocPhaseNames[phase], atomic_load (&allocStats.count[phase]), atomic_load (&allocStats.bytes[phase]));
+    }
+
+    // Busiest call sites, picked out of the table by repeated passes so nothing allocates
+    bool reported[ALLOC_SITES] = { 0 };
+
+    for (int rank = 0; rank < 10; rank++)
+    {
+        int best = -1;
+
+        for (int i = 0; i < ALLOC_SITES; i++)
+        {
+            if (reported[i] || atomic_load (&allocStats.sites[i].address) == 0) continue;
+            if (best < 0 || atomic_load (&allocStats.sites[i].count) > atomic_load (&allocStats.sites[best].count)) best = i;
+        }
+
+        if (best < 0) break;
+        reported[best] = true;
+
+        void *address = (void *)atomic_load (&allocStats.sites[best].address);
+        Dl_info info = { 0 };
+        const char *where = "?";
+        uintptr_t offset = (uintptr_t)address;
+
+        if (dladdr (address, &info) != 0)
+        {
+            where = (info.dli_sname != NULL) ? info.dli_sname : info.dli_fname;
+            offset -= (uintptr_t)((info.dli_sname != NULL) ? info.dli_saddr : info.dli_fbase);
+        }
+
+        TraceLog (LOG_INFO, "ALLOC:   %8d allocations %12zu bytes from %s+0x%lx", atomic_load (&allocStats.sites[best].count),
+            atomic_load (&allocStats.sites[best].bytes), where, (unsigned long)offset);
+    }
+}
+
+#else
+
+// -1: not tracked in this build
+static int EndAllocFrame (bool checked)
+{
+    (void)checked;
+    return -1;
+}
+
+static void LogAllocReport (void)
+{
+}
+
+#endif
+
+// Frame arena
+
+static void InitFrameArena (FrameArena *arena, size_t capacity, bool poison)
+{
+    *arena = (FrameArena){ 0 };
+    arena->base = MemAlloc ((unsigned int)capacity);
+    arena->capacity = (arena->base != NULL) ? capacity : 0;
+    arena->poison = poison;
+
+    if (poison && arena->base != NULL) memset (arena->base, ARENA_POISON, capacity);
+}
+
+// Call at the top of every frame, everything handed out last frame is gone
+static void ResetFrameArena (FrameArena *arena)
+{
+    if (arena->used > arena->peak) arena->peak = arena->used;
+    if (arena->poison) memset (arena->base, ARENA_POISON, arena->used);
+
+    arena->used = 0;
+}
+
+// NULL if it does not fit, the frame goes on without it
+static void *ArenaAlloc (FrameArena *arena, size_t size)
+{
+    size_t offset = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (offset + size > arena->capacity)
+    {
+        arena->failed++;
+        return NULL;
+    }
+
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+// Drop-in for TextFormat, valid until the end of the frame. An empty string if the arena is full.
+static const char *ArenaFormat (FrameArena *arena, const char *format, ...)
+{
+    va_list args;
+    va_start (args, format);
+    int length = vsnprintf (NULL, 0, format, args);
+    va_end (args);
+
+    char *text = (length >= 0) ? ArenaAlloc (arena, (size_t)length + 1) : NULL;
+    if (text == NULL) return "";
+
+    va_start (args, format);
+    vsnprintf (text, (size_t)length + 1, format, args);
+    va_end (args);
+
+    return text;
+}
+
+static void UnloadFrameArena (FrameArena *arena)
+{
+    MemFree (arena->base);
+    *arena = (FrameArena){ 0 };
+}
+
+// Text cache
+
+static void InitTextCache (TextCache *cache)
+{
+    memset (cache, 0, sizeof (*cache));
+}
+
+static uint32_t HashText (const char *text, unsigned int fontId, int fontSize)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = text; *c != '\0'; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+    hash = (hash ^ fontId) * 16777619u;
+    hash = (hash ^ (uint32_t)fontSize) * 16777619u;
+    return hash;
+}
+
+// Same layout as DrawTextEx, done once. Returns false if the string does not fit in a run.
+static bool LayoutTextRun (TextRun *run, Font font, const char *text, int fontSize)
+{
+    size_t length = strlen (text);
+    if (length >= TEXT_RUN_BYTES) return false;
+
+    // DrawText spacing for the default font
+    int spacing = (fontSize < 10 ? 10 : fontSize) / 10;
+    float scale = (float)fontSize / (float)font.baseSize;
+    float padding = (float)font.glyphPadding;
+    float offsetX = 0.0f;
+    float offsetY = 0.0f;
+    float lineWidth = 0.0f;
+    int quadCount = 0;
+
+    run->width = 0.0f;
+
+    for (int i = 0; i < (int)length;)
+    {
+        int codepointSize = 0;
+        int codepoint = GetCodepointNext (&text[i], &codepointSize);
+        i += codepointSize;
+
+        if (codepoint == '\n')
+        {
+            run->width = fmaxf (run->width, lineWidth - spacing);
+            offsetX = 0.0f;
+            offsetY += fontSize + 2;
+            lineWidth = 0.0f;
+            continue;
+        }
+
+        int index = GetGlyphIndex (font, codepoint);
+        Rectangle rec = font.recs[index];
+
+        if (codepoint != ' ' && codepoint != '\t')
+        {
+            if (quadCount == TEXT_RUN_GLYPHS) return false;
+
+            run->quads[quadCount++] = (GlyphQuad){
+                .source = { rec.x - padding, rec.y - padding, rec.width + 2.0f * padding, rec.height + 2.0f * padding },
+                .dest = {
+                    offsetX + (font.glyphs[index].offsetX - padding) * scale,
+                    offsetY + (font.glyphs[index].offsetY - padding) * scale,
+                    (rec.width + 2.0f * padding) * scale,
+                    (rec.height + 2.0f * padding) * scale
+                }
+            };
+        }
+
+        float advance = (font.glyphs[index].advanceX == 0) ? rec.width * scale : font.glyphs[index].advanceX * scale;
+        offsetX += advance + spacing;
+        lineWidth += advance + spacing;
+    }
+
+    run->width = fmaxf (run->width, lineWidth - spacing);
+    run->quadCount = quadCount;
+    memcpy (run->text, text, length + 1);
+    run->fontId = font.texture.id;
+    run->fontSize = fontSize;
+    run->hash = HashText (text, font.texture.id, fontSize);
+    return true;
+}
+
+// Returns the cached layout, laying the string out on a miss. NULL if it is too long to cache.
+static const TextRun *GetTextRun (TextCache *cache, Font font, const char *text, int fontSize)
+{
+    uint32_t hash = HashText (text, font.texture.id, fontSize);
+    TextRun *oldest = &cache->runs[0];
+
+    cache->clock++;
+
+    for (int i = 0; i < TEXT_CACHE_RUNS; i++)
+    {
+        TextRun *run = &cache->runs[i];
+
+        if (run->used && run->hash == hash && run->fontId == font.texture.id && run->fontSize == fontSize &&
+            strcmp (run->text, text) == 0)
+        {
+            run->lastUsed = cache->clock;
+            cache->hits++;
+            return run;
+        }
+
+        if (!run->used) oldest = run;
+        else if (oldest->used && run->lastUsed < oldest->lastUsed) oldest = run;
+    }
+
+    cache->misses++;
+    oldest->used = LayoutTextRun (oldest, font, text, fontSize);
+    if (!oldest->used) return NULL;
+
+    oldest->lastUsed = cache->clock;
+    return oldest;
+}
+
+static int MeasureCachedText (TextCache *cache, const char *text, int fontSize)
+{
+    const TextRun *run = GetTextRun (cache, GetFontDefault (), text, fontSize);
+    return run ? (int)run->width : MeasureText (text, fontSize);
+}
+
+// Drop-in for DrawText. Every quad samples the font texture, so raylib submits the run as one batch.
+static void DrawCachedText (TextCache *cache, const char *text, int posX, int posY, int fontSize, Color color)
+{
+    Font font = GetFontDefault ();
+    const TextRun *run = GetTextRun (cache, font, text, fontSize);
+
+    if (run == NULL)
+    {
+        DrawText (text, posX, posY, fontSize, color);
+        return;
+    }
+
+    for (int i = 0; i < run->quadCount; i++)
+    {
+        Rectangle dest = run->quads[i].dest;
+        dest.x += posX;
+        dest.y += posY;
+        DrawTexturePro (font.texture, run->quads[i].source, dest, (Vector2){ 0.0f, 0.0f }, 0.0f, color);
+    }
+}
+
+// Player HUD
+
+static void DrawPlayerHud (PlayerHud *hud, const HudValues *values, TextCache *textCache, FrameArena *arena)
+{
+    // Background bar
+    DrawRectangleRec (hud->backgroundBar, GRAY);
+
+    // Health bar
+    float healthPercent = (float)values->health / (float)values->maxHealth;
+    hud->healthBar.width = healthPercent * hud->backgroundBar.width;
+
+    Color healthColor = GREEN;
+    if (healthPercent <= 0.5f && healthPercent > 0.3f) healthColor = YELLOW;
+    else if (healthPercent <= 0.3f) healthColor = RED;
+    DrawRectangleRec (hud->healthBar, healthColor);
+    
+    // Dollars
+    DrawCachedText (
+        textCache,
+        ArenaFormat (arena, "$: %d", values->dollars), 
+        hud->dollarsPosition.x, 
+        hud->dollarsPosition.y, 
+        hud->fontSize, 
+        hud->moneyColor
+    );
+
+    // Weapon, next to the bars
+    DrawCachedText (
+        textCache,
+        weapons[values->weapon].name,
+        hud->backgroundBar.x + hud->backgroundBar.width + 20.0f,
+        hud->backgroundBar.y + hud->backgroundBar.height/2.0f - 10.0f,
+        20,
+        DARKGRAY
+    );
+}
+
+// Frame pacing
+
+// Gameplay rate of the mode, 0 leaves the rate to vsync or to nothing at all
+static int GetPacingFps (PacingMode mode)
+{
+    return (mode == PACING_VSYNC) ? 60 : 0;
+}
+
+static void InitFramePacer (FramePacer *pacer, bool idleAware, PacingMode mode)
+{
+    *pacer = (FramePacer){ 0 };
+    pacer->idleAware = idleAware;
+    pacer->mode = mode;
+    pacer->targetFps = GetPacingFps (mode);
+    pacer->waitingEvents = false;
+    SetTargetFPS (pacer->targetFps);
+
+    int refreshRate = GetMonitorRefreshRate (GetCurrentMonitor ());
+    pacer->refreshInterval = 1.0f / ((refreshRate > 0) ? refreshRate : 60);
+    pacer->presented = GetWallTime ();
+    pacer->workStart = pacer->presented;
+}
+
+// Call after the update so a state change made this frame already applies to this frame's EndDrawing.
+// loading keeps frames coming while atlases are on their way, uploads only move once per frame.
+static void UpdateFramePacer (FramePacer *pacer, GameState state, bool paused, bool loading)
+{
+    int targetFps = GetPacingFps (pacer->mode);
+    bool waitEvents = false;
+
+    if (pacer->idleAware && !loading)
+    {
+        switch (state)
+        {
+        case STATE_START:
+            targetFps = IDLE_ANIMATION_FPS; // Only the prompt fades in and out
+            break;
+
+        case STATE_MENU:
+        case STATE_GAMEOVER:
+            waitEvents = true;              // Nothing changes without input
+            break;
+
+        case STATE_GAMEPLAY:
+            waitEvents = paused;            // Focus coming back is an event too
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (targetFps != pacer->targetFps)
+    {
+        SetTargetFPS (targetFps);
+        pacer->targetFps = targetFps;
+    }
+
+    if (waitEvents != pacer->waitingEvents)
+    {
+        if (waitEvents) EnableEventWaiting ();
+        else DisableEventWaiting ();
+        pacer->waitingEvents = waitEvents;
+    }
+}
+
+// Top of the frame. In low latency gameplay, sleeps until the predicted cost of the frame just fits before
+// the next vblank. Returns true if it slept, the input polled by EndDrawing is stale by then.
+static bool WaitForFrameDeadline (FramePacer *pacer, GameState state, bool paused)
+{
+    double now = GetWallTime ();
+    bool waited = false;
+
+    if (pacer->mode == PACING_LOW_LATENCY && state == STATE_GAMEPLAY && !paused)
+    {
+        double wake = pacer->presented + pacer->refreshInterval - pacer->predicted - PACING_MARGIN;
+
+        if (wake > now)
+        {
+            WaitTime (wake - now);
+            now = GetWallTime ();
+            waited = true;
+        }
+    }
+
+    pacer->workStart = now;
+    return waited;
+}
+
+// Right before EndDrawing: the frame's work is done. The prediction is the slowest recent frame,
+// a frame that misses the vblank costs a whole refresh, coming in early only a little latency.
+static void MarkFrameSubmitted (FramePacer *pacer)
+{
+    pacer->work[pacer->workIndex] = (float)(GetWallTime () - pacer->workStart);
+    pacer->workIndex = (pacer->workIndex + 1) % PACING_WINDOW;
+
+    pacer->predicted = 0.0f;
+    for (int i = 0; i < PACING_WINDOW; i++) pacer->predicted = fmaxf (pacer->predicted, pacer->work[i]);
+}
+
+// Right after EndDrawing
+static void MarkFramePresented (FramePacer *pacer)
+{
+    pacer->presented = GetWallTime ();
+}
+
+// Input
+
+// Keys read through WasKeyPressed, a press seen by the low latency poll would be gone by the next update otherwise
+static const int watchedKeys[] = { KEY_ENTER, KEY_F3, KEY_ONE, KEY_TWO, KEY_THREE };
+
+static InputQueue *mouseButtonQueue;            // Where OnMouseButton queues presses
+static GLFWmousebuttonfun raylibMouseButton;    // Raylib's own callback, still sees every event
+
+// Runs inside the poll, raylib has already moved the cursor to where the button went down
+static void OnMouseButton (GLFWwindow *window, int button, int action, int mods)
+{
+    InputQueue *input = mouseButtonQueue;
+
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+    {
+        input->clicked = true;
+
+        if (input->count == INPUT_QUEUE_SIZE) input->dropped++;
+        else
+        {
+            input->events[(input->head + input->count) % INPUT_QUEUE_SIZE] = (InputEvent){ glfwGetTime (), GetViewportMouse (input->viewport) };
+            input->count++;
+        }
+    }
+
+    if (raylibMouseButton != NULL) raylibMouseButton (window, button, action, mods);
+}
+
+// After InitWindow. Puts OnMouseButton in front of raylib's callback.
+static void InitInputQueue (InputQueue *input, const GameViewport *viewport)
+{
+    *input = (InputQueue){ 0 };
+    input->viewport = viewport;
+
+    mouseButtonQueue = input;
+    raylibMouseButton = glfwSetMouseButtonCallback ((GLFWwindow *)GetWindowHandle (), OnMouseButton);
+}
+
+static void UnloadInputQueue (InputQueue *input)
+{
+    glfwSetMouseButtonCallback ((GLFWwindow *)GetWindowHandle (), raylibMouseButton);
+    mouseButtonQueue = NULL;
+    input->count = 0;
+}
+
+// Latches the watched keys. Call after every poll: with poll = false right after EndDrawing, which already
+// polled, with poll = true where a frame needs input fresher than that.
+static void PumpInput (InputQueue *input, bool poll)
+{
+    if (poll) PollInputEvents ();
+
+    for (int i = 0; i < (int)(sizeof (watchedKeys) / sizeof (watchedKeys[0])); i++)
+    {
+        if (IsKeyPressed (watchedKeys[i])) input->keys |= 1u << i;
+    }
+}
+
+static bool WasKeyPressed (const InputQueue *input, int key)
+{
+    for (int i = 0; i < (int)(sizeof (watchedKeys) / sizeof (watchedKeys[0])); i++)
+    {
+        if (watchedKeys[i] == key) return (input->keys & (1u << i)) != 0;
+    }
+
+    return IsKeyPressed (key);
+}
+
+static bool WasMousePressed (const InputQueue *input)
+{
+    return input->clicked;
+}
+
+// Oldest click, false if there is none
+static bool TakeInputEvent (InputQueue *input, InputEvent *event)
+{
+    if (input->count == 0) return false;
+
+    *event = input->events[input->head];
+    input->head = (input->head + 1) % INPUT_QUEUE_SIZE;
+    input->count--;
+
+    return true;
+}
+
+// Call once the frame's update has read the presses, the next poll collects them for the next frame
+static void ResetInputFrame (InputQueue *input)
+{
+    input->keys = 0;
+    input->clicked = false;
+}
+
+static void ClearInputQueue (InputQueue *input)
+{
+    input->head = 0;
+    input->count = 0;
+}
+
+// Latency probe
+
+static void InitLatencyProbe (LatencyProbe *probe, bool enabled)
+{
+    *probe = (LatencyProbe){ 0 };
+    probe->enabled = enabled;
+}
+
+// A click taken into the tick with this number
+static void TagLatencyInput (LatencyProbe *probe, double time, unsigned int tick)
+{
+    if (!probe->enabled || probe->pendingCount == LATENCY_PENDING) return;
+
+    probe->pending[probe->pendingCount++] = (LatencySample){ time, tick };
+}
+
+// Call right after EndDrawing with the tick the frame showed
+static void ResolveLatencyProbe (LatencyProbe *probe, unsigned int shownTick, double now)
+{
+    int kept = 0;
+
+    for (int i = 0; i < probe->pendingCount; i++)
+    {
+        LatencySample sample = probe->pending[i];
+
+        if (sample.tick > shownTick)
+        {
+            probe->pending[kept++] = sample;
+            continue;
+        }
+
+        double latency = fmax (now - sample.time, 0.0);
+        int bin = (int)(latency*1000.0);
+        probe->bins[(bin < LATENCY_BINS) ? bin : LATENCY_BINS]++;
+        probe->count++;
+        probe->total += latency;
+        probe->worst = fmax (probe->worst, latency);
+    }
+
+    probe->pendingCount = kept;
+}
+
+// Upper edge of the bin holding the given fraction of the samples, in milliseconds
+static int GetLatencyPercentile (const LatencyProbe *probe, float fraction)
+{
+    int target = (int)ceilf (fraction * probe->count);
+    int seen = 0;
+
+    for (int i = 0; i < LATENCY_BINS; i++)
+    {
+        seen += probe->bins[i];
+        if (seen >= target) return i + 1;
+    }
+
+    return LATENCY_BINS + 1;
+}
+
+static void LogLatencyReport (const LatencyProbe *probe, const char *pacing)
+{
+    if (!probe->enabled) return;
+
+    if (probe->count == 0)
+    {
+        TraceLog (LOG_INFO, "LATENCY: No clicks measured (%s)", pacing);
+        return;
+    }
+
+    TraceLog (LOG_INFO, "LATENCY: %d clicks (%s), mean %.1f ms, p50 %d ms, p90 %d ms, p99 %d ms, worst %.1f ms",
+        probe->count, pacing, probe->total / probe->count * 1000.0, GetLatencyPercentile (probe, 0.5f),
+        GetLatencyPercentile (probe, 0.9f), GetLatencyPercentile (probe, 0.99f), probe->worst * 1000.0);
+
+    int tallest = 0;
+    for (int i = 0; i <= LATENCY_BINS; i++) tallest = (probe->bins[i] > tallest) ? probe->bins[i] : tallest;
+
+    for (int i = 0; i <= LATENCY_BINS; i++)
+    {
+        if (probe->bins[i] == 0) continue;
+
+        char bar[41] = { 0 };
+        memset (bar, '#', (size_t)(1 + 39 * probe->bins[i] / tallest));
+
+        if (i < LATENCY_BINS) TraceLog (LOG_INFO, "LATENCY: %3d-%3d ms %-40s %d", i, i + 1, bar, probe->bins[i]);
+        else TraceLog (LOG_INFO, "LATENCY:   >%3d ms %-40s %d", LATENCY_BINS, bar, probe->bins[i]);
+    }
+}
+
+// Entity handles
+
+static void InitHandles (HandleSlotPool *handles)
+{
+    InitHandleSlotPool (handles);
+
+    for (int i = 0; i < MAX_ENTITIES; i++) handles->items[i] = (HandleSlot){ -1, 1 };
+}
+
+// Returns HANDLE_NONE when every slot is taken
+static EntityHandle AcquireHandle (HandleSlotPool *handles, int location)
+{
+    int slot = AcquireHandleSlot (handles);
+    if (slot < 0) return HANDLE_NONE;
+
+    handles->items[slot].location = location;
+
+    return ((EntityHandle)handles->items[slot].generation << HANDLE_SLOT_BITS) | (EntityHandle)slot;
+}
+
+// Bumping the generation invalidates every copy of the handle, so the slot can be reused right away
+static void ReleaseHandle (HandleSlotPool *handles, EntityHandle handle)
+{
+    int slot = handle & HANDLE_SLOT_MASK;
+
+    handles->items[slot].location = -1;
+    if (++handles->items[slot].generation == 0) handles->items[slot].generation = 1;
+    ReleaseHandleSlot (handles, slot);
+}
+
+// Current location of the entity behind the handle, -1 if it is gone
+static int HandleIndex (const HandleSlotPool *handles, EntityHandle handle)
+{
+    int slot = handle & HANDLE_SLOT_MASK;
+
+    if (slot >= MAX_ENTITIES || handles->items[slot].generation != (handle >> HANDLE_SLOT_BITS)) return -1;
+
+    return handles->items[slot].location;
+}
+
+static void MoveHandle (HandleSlotPool *handles, EntityHandle handle, int location)
+{
+    handles->items[handle & HANDLE_SLOT_MASK].location = location;
+}
+
+// Archetype entity store
+
+// Tags take no space in a chunk
+static const int componentSize[COMPONENT_COUNT] =
+{
+    [COMPONENT_POSITION]  = sizeof (Vector2),
+    [COMPONENT_DIRECTION] = sizeof (Vector2),
+    [COMPONENT_VELOCITY]  = sizeof (Vector2),
+    [COMPONENT_HEALTH]    = sizeof (int),
+    [COMPONENT_LIFE]      = sizeof (float),
+    [COMPONENT_ENEMY]     = 0,
+    [COMPONENT_BULLET]    = 0,
+    [COMPONENT_PARTICLE]  = 0,
+};
+
+#define ENTITY_LOCATION(chunk, row) (((chunk) << 16) | (row))
+#define LOCATION_CHUNK(location) ((location) >> 16)
+#define LOCATION_ROW(location) ((location) & 0xFFFF)
+
+static void InitWorld (World *world)
+{
+    world->archetypeCount = 0;
+    world->pendingCount = 0;
+
+    InitChunkPool (&world->chunks);
+    for (int i = 0; i < MAX_CHUNKS; i++) world->chunks.items[i].data = world->chunkData[i];
+
+    InitHandles (&world->handles);
+}
+
+// Returns the archetype storing exactly this component set and type, creating it on first use
+static int FindArchetype (World *world, uint32_t mask, int type)
+{
+    for (int i = 0; i < world->archetypeCount; i++)
+    {
+        if (world->archetypes[i].mask == mask && world->archetypes[i].type == type) return i;
+    }
+
+    if (world->archetypeCount == MAX_ARCHETYPES) return -1;
+
+    Archetype *archetype = &world->archetypes[world->archetypeCount];
+    int entitySize = sizeof (EntityHandle);
+
+    for (int c = 0; c < COMPONENT_COUNT; c++)
+    {
+        if (mask & COMPONENT_BIT (c)) entitySize += componentSize[c];
+    }
+
+    // Leave room for each array to start on a 16 byte boundary
+    archetype->mask = mask;
+    archetype->type = type;
+    archetype->capacity = (CHUNK_BYTES - 16*(COMPONENT_COUNT + 1)) / entitySize;
+    archetype->chunkCount = 0;
+    archetype->count = 0;
+
+    int offset = 0;
+    for (int c = 0; c < COMPONENT_COUNT; c++)
+    {
+        archetype->offset[c] = -1;
+        if (mask & COMPONENT_BIT (c))
+        {
+            archetype->offset[c] = offset;
+            offset += (componentSize[c] * archetype->capacity + 15) & ~15;
+        }
+    }
+    archetype->handleOffset = offset;
+
+    return world->archetypeCount++;
+}
+
+static inline void *ChunkComponent (const Archetype *archetype, Chunk *chunk, ComponentId component, int row)
+{
+    return chunk->data + archetype->offset[component] + row*componentSize[component];
+}
+
+static inline EntityHandle *ChunkHandles (const Archetype *archetype, Chunk *chunk)
+{
+    return (EntityHandle *)(chunk->data + archetype->handleOffset);
+}
+
+// Adds an entity with zeroed components, fill them in through GetComponent
+static EntityHandle CreateEntity (World *world, int archetypeIndex)
+{
+    if (archetypeIndex < 0) return HANDLE_NONE;
+
+    EntityHandle handle = AcquireHandle (&world->handles, -1);
+    if (handle == HANDLE_NONE) return HANDLE_NONE;
+
+    Archetype *archetype = &world->archetypes[archetypeIndex];
+    int row = archetype->count % archetype->capacity;
+
+    if (row == 0)
+    {
+        // Last chunk is full (or there is none yet)
+        int chunkIndex = AcquireChunk (&world->chunks);
+        if (chunkIndex < 0)
+        {
+            ReleaseHandle (&world->handles, handle);
+            return HANDLE_NONE;
+        }
+
+        world->chunks.items[chunkIndex].archetype = archetypeIndex;
+        world->chunks.items[chunkIndex].count = 0;
+        archetype->chunks[archetype->chunkCount++] = chunkIndex;
+    }
+
+    int chunkIndex = archetype->chunks[archetype->chunkCount - 1];
+    Chunk *chunk = &world->chunks.items[chunkIndex];
+
+    for (int c = 0; c < COMPONENT_COUNT; c++)
+    {
+        if (archetype->offset[c] >= 0) memset (ChunkComponent (archetype, chunk, c, row), 0, componentSize[c]);
+    }
+
+    MoveHandle (&world->handles, handle, ENTITY_LOCATION (chunkIndex, row));
+    ChunkHandles (archetype, chunk)[row] = handle;
+    chunk->count++;
+    archetype->count++;
+
+    return handle;
+}
+
+// Returns NULL if the entity is gone or does not have the component
+static void *GetComponent (World *world, EntityHandle handle, ComponentId component)
+{
+    int location = HandleIndex (&world->handles, handle);
+    if (location < 0) return NULL;
+
+    Chunk *chunk = &world->chunks.items[LOCATION_CHUNK (location)];
+    const Archetype *archetype = &world->archetypes[chunk->archetype];
+    if (archetype->offset[component] < 0) return NULL;
+
+    return ChunkComponent (archetype, chunk, component, LOCATION_ROW (location));
+}
+
+// Removes the entity right away by moving the last entity of its archetype into its row.
+// Do not call this while iterating the same archetype, use QueueDestroy instead.
+static void DestroyEntity (World *world, EntityHandle handle)
+{
+    int location = HandleIndex (&world->handles, handle);
+    if (location < 0) return;
+
+    Chunk *chunk = &world->chunks.items[LOCATION_CHUNK (location)];
+    int row = LOCATION_ROW (location);
+    Archetype *archetype = &world->archetypes[chunk->archetype];
+    int lastChunkIndex = archetype->chunks[archetype->chunkCount - 1];
+    Chunk *lastChunk = &world->chunks.items[lastChunkIndex];
+    int lastRow = lastChunk->count - 1;
+
+    ReleaseHandle (&world->handles, handle);
+
+    if (chunk != lastChunk || row != lastRow)
+    {
+        for (int c = 0; c < COMPONENT_COUNT; c++)
+        {
+            if (archetype->offset[c] >= 0)
+            {
+                memcpy (ChunkComponent (archetype, chunk, c, row), ChunkComponent (archetype, lastChunk, c, lastRow), componentSize[c]);
+            }
+        }
+
+        EntityHandle moved = ChunkHandles (archetype, lastChunk)[lastRow];
+        ChunkHandles (archetype, chunk)[row] = moved;
+        MoveHandle (&world->handles, moved, ENTITY_LOCATION ((int)(chunk - world->chunks.items), row));
+    }
+
+    lastChunk->count--;
+    archetype->count--;
+
+    if (lastChunk->count == 0)
+    {
+        archetype->chunkCount--;
+        ReleaseChunk (&world->chunks, lastChunkIndex);
+    }
+}
+
+// Destruction requested while a query is running, applied by FlushDestroyed
+static void QueueDestroy (World *world, EntityHandle handle)
+{
+    world->pendingDestroy[world->pendingCount++] = handle;
+}
+
+static void FlushDestroyed (World *world)
+{
+    // Stale handles (entity queued twice) are ignored by DestroyEntity
+    for (int i = 0; i < world->pendingCount; i++) DestroyEntity (world, world->pendingDestroy[i]);
+
+    world->pendingCount = 0;
+}
+
+// Destroys every entity, only touches live chunks
+static void ClearWorld (World *world)
+{
+    for (int a = 0; a < world->archetypeCount; a++)
+    {
+        Archetype *archetype = &world->archetypes[a];
+
+        for (int i = 0; i < archetype->chunkCount; i++)
+        {
+            Chunk *chunk = &world->chunks.items[archetype->chunks[i]];
+            EntityHandle *handles = ChunkHandles (archetype, chunk);
+
+            for (int row = 0; row < chunk->count; row++) ReleaseHandle (&world->handles, handles[row]);
+
+            ReleaseChunk (&world->chunks, archetype->chunks[i]);
+        }
+
+        archetype->chunkCount = 0;
+        archetype->count = 0;
+    }
+
+    world->pendingCount = 0;
+}
+
+static Query BeginQuery (uint32_t mask)
+{
+    return (Query){ mask, 0, 0 };
+}
+
+// Hands out the next chunk with all the requested components, false when there are none left
+static bool NextChunk (World *world, Query *query, ChunkView *view)
+{
+    for (; query->archetype < world->archetypeCount; query->archetype++, query->chunk = 0)
+    {
+        Archetype *archetype = &world->archetypes[query->archetype];
+
+        if ((archetype->mask & query->mask) != query->mask || query->chunk >= archetype->chunkCount) continue;
+
+        Chunk *chunk = &world->chunks.items[archetype->chunks[query->chunk++]];
+
+        view->count = chunk->count;
+        view->type = archetype->type;
+        view->handle = ChunkHandles (archetype, chunk);
+        for (int c = 0; c < COMPONENT_COUNT; c++)
+        {
+            view->component[c] = (query->mask & COMPONENT_BIT (c)) ? chunk->data + archetype->offset[c] : NULL;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+// Enemies, bullets and sparks
+
+// Number of entities that have at least the given components, over all types
+static int CountEntities (const World *world, uint32_t mask)
+{
+    int count = 0;
+
+    for (int i = 0; i < world->archetypeCount; i++)
+    {
+        if ((world->archetypes[i].mask & mask) == mask) count += world->archetypes[i].count;
+    }
+
+    return count;
+}
+
+static EntityHandle SpawnEnemy (World *world, EnemyType type, Vector2 position)
+{
+    if (CountEntities (world, ENEMY_COMPONENTS) >= MAX_ENEMIES) return HANDLE_NONE;
+
+    EntityHandle handle = CreateEntity (world, FindArchetype (world, ENEMY_COMPONENTS, type));
+    if (handle == HANDLE_NONE) return HANDLE_NONE;
+
+    *(Vector2 *)GetComponent (world, handle, COMPONENT_POSITION) = position;
+    *(int *)GetComponent (world, handle, COMPONENT_HEALTH) = enemyTypes[type].health;
+
+    return handle;
+}
+
+// Sparks thrown off by a kill of the given enemy type, they live for PARTICLE_LIFE seconds.
+// Safe inside a query over enemies or bullets, sparks are archetypes of their own.
+static void SpawnSparks (World *world, EnemyType type, Vector2 center)
+{
+    if (CountEntities (world, PARTICLE_COMPONENTS) + PARTICLES_PER_KILL > MAX_PARTICLES) return;
+
+    for (int i = 0; i < PARTICLES_PER_KILL; i++)
+    {
+        EntityHandle handle = CreateEntity (world, FindArchetype (world, PARTICLE_COMPONENTS, type));
+        if (handle == HANDLE_NONE) return;
+
+        float angle = (i + GetRandomValue (0, 100) / 100.0f) * 2.0f * PI / PARTICLES_PER_KILL;
+        float speed = PARTICLE_SPEED * GetRandomValue (50, 100) / 100.0f;
+
+        *(Vector2 *)GetComponent (world, handle, COMPONENT_POSITION) = center;
+        *(Vector2 *)GetComponent (world, handle, COMPONENT_VELOCITY) = (Vector2){ cosf (angle) * speed, sinf (angle) * speed };
+        *(float *)GetComponent (world, handle, COMPONENT_LIFE) = PARTICLE_LIFE;
+    }
+}
+
+// Sparks fly and fade, the ones whose life ran out are destroyed
+static void UpdateParticles (World *world, float dt)
+{
+    ChunkView view;
+
+    for (Query q = BeginQuery (PARTICLE_COMPONENTS); NextChunk (world, &q, &view); )
+    {
+        Vector2 *position = view.component[COMPONENT_POSITION];
+        Vector2 *velocity = view.component[COMPONENT_VELOCITY];
+        float *life = view.component[COMPONENT_LIFE];
+
+        for (int i = 0; i < view.count; i++)
+        {
+            life[i] -= dt;
+            position[i].x += velocity[i].x * dt;
+            position[i].y += velocity[i].y * dt;
+
+            if (life[i] <= 0.0f) QueueDestroy (world, view.handle[i]);
+        }
+    }
+    FlushDestroyed (world);
+}
+
+static EntityHandle FireBullet (World *world, BulletType type, Vector2 position, Vector2 direction)
+{
+    if (CountEntities (world, BULLET_COMPONENTS) >= MAX_BULLETS) return HANDLE_NONE;
+
+    EntityHandle handle = CreateEntity (world, FindArchetype (world, BULLET_COMPONENTS, type));
+    if (handle == HANDLE_NONE) return HANDLE_NONE;
+
+    *(Vector2 *)GetComponent (world, handle, COMPONENT_POSITION) = position;
+    *(Vector2 *)GetComponent (world, handle, COMPONENT_DIRECTION) = direction;
+
+    return handle;
+}
+
+// One shot of a weapon towards target. age is how long ago the shot happened, its bullets start that far along.
+static void FireWeapon (World *world, const WeaponDef *weapon, Vector2 origin, Vector2 target, float age)
+{
+    float speed = bulletTypes[weapon->bullet].speed;
+    float aim = atan2f (target.y - origin.y, target.x - origin.x);
+
+    for (int i = 0; i < weapon->projectiles; i++)
+    {
+        float angle = aim + weapon->spread * ((i + 0.5f) / weapon->projectiles - 0.5f);
+        angle += weapon->jitter * (GetRandomValue (-500, 500) / 1000.0f);
+
+        Vector2 direction = { cosf (angle), sinf (angle) };
+        Vector2 position = Vector2Add (origin, Vector2Scale (direction, speed * age));
+
+        if (FireBullet (world, weapon->bullet, position, direction) == HANDLE_NONE) return; // All bullets are in flight
+    }
+}
+
+// Sprite atlas
+
+static const char *atlasGroupNames[ATLAS_GROUP_COUNT] = { "title", "game" };
+
+// Images packed into the atlases. Shapes are generated into the game atlas, everything else comes from resources/images.
+static const struct { const char *name; const char *path; AtlasGroup group; } atlasImages[] =
+{
+    { "logo", "resources/images/logo.png", ATLAS_TITLE },
+};
+
+#define ATLAS_IMAGE_COUNT (int)(sizeof (atlasImages) / sizeof (atlasImages[0]))
+
+// Circle for bullets and a white square whose middle tints to any solid color, returns how many it added
+static int GenAtlasShapes (AtlasSprite *sprites, Image *images)
+{
+    int count = 0;
+
+    images[count] = GenImageColor (SPRITE_SHAPE_SIZE, SPRITE_SHAPE_SIZE, BLANK);
+    ImageDrawCircleV (&images[count], (Vector2){ SPRITE_SHAPE_SIZE/2.0f, SPRITE_SHAPE_SIZE/2.0f }, SPRITE_SHAPE_SIZE/2 - 1, WHITE);
+    strcpy (sprites[count++].name, "circle");
+
+    images[count] = GenImageColor (SPRITE_SHAPE_SIZE/4, SPRITE_SHAPE_SIZE/4, WHITE);
+    strcpy (sprites[count++].name, "solid");
+
+    return count;
+}
+
+// Loads the inputs of one atlas into images, names and images must hold ATLAS_MAX_SPRITES
+static int LoadAtlasImages (AtlasGroup group, AtlasSprite *sprites, Image *images)
+{
+    int count = (group == ATLAS_GAME) ? GenAtlasShapes (sprites, images) : 0;
+
+    for (int i = 0; i < ATLAS_IMAGE_COUNT && count < ATLAS_MAX_SPRITES; i++)
+    {
+        if (atlasImages[i].group != group) continue;
+
+        images[count] = LoadImage (atlasImages[i].path);
+        if (images[count].data == NULL) continue;
+
+        ImageFormat (&images[count], PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+        strncpy (sprites[count].name, atlasImages[i].name, ATLAS_NAME_BYTES - 1);
+        sprites[count].name[ATLAS_NAME_BYTES - 1] = '\0';
+        count++;
+    }
+
+    return count;
+}
+
+// Shelf packing, tallest images first, at the smallest power of two size that fits.
+// Fills in the source rectangles and returns the atlas size, 0 if nothing fits in ATLAS_MAX_SIZE.
+static int PackAtlas (AtlasSprite *sprites, const Image *images, int count)
+{
+    int order[ATLAS_MAX_SPRITES];
+    for (int i = 0; i < count; i++) order[i] = i;
+
+    for (int i = 1; i < count; i++)
+    {
+        for (int j = i; j > 0 && images[order[j]].height > images[order[j - 1]].height; j--)
+        {
+            int swap = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = swap;
+        }
+    }
+
+    for (int size = 64; size <= ATLAS_MAX_SIZE; size *= 2)
+    {
+        int x = ATLAS_PADDING;
+        int y = ATLAS_PADDING;
+        int shelfHeight = 0;
+        bool fits = true;
+
+        for (int i = 0; i < count && fits; i++)
+        {
+            const Image *image = &images[order[i]];
+
+            if (x + image->width + ATLAS_PADDING > size)
+            {
+                x = ATLAS_PADDING;
+                y += shelfHeight + ATLAS_PADDING;
+                shelfHeight = 0;
+            }
+
+            fits = x + image->width + ATLAS_PADDING <= size && y + image->height + ATLAS_PADDING <= size;
+
+            sprites[order[i]].source = (Rectangle){ (float)x, (float)y, (float)image->width, (float)image->height };
+            x += image->width + ATLAS_PADDING;
+            if (image->height > shelfHeight) shelfHeight = image->height;
+        }
+
+        if (fits) return size;
+    }
+
+    return 0;
+}
+
+// Packs images into one and unloads them, fills in the sprite rectangles. count drops to 0 if they do not fit.
+static Image ComposeAtlasImage (AtlasSprite *sprites, Image *images, int *count)
+{
+    int size = PackAtlas (sprites, images, *count);
+    if (size == 0) TraceLog (LOG_WARNING, "ATLAS: Images do not fit in %dx%d", ATLAS_MAX_SIZE, ATLAS_MAX_SIZE);
+
+    Image atlas = GenImageColor (size > 0 ? size : 1, size > 0 ? size : 1, BLANK);
+
+    for (int i = 0; i < *count; i++)
+    {
+        if (size > 0)
+        {
+            Rectangle source = { 0.0f, 0.0f, (float)images[i].width, (float)images[i].height };
+            ImageDraw (&atlas, images[i], source, sprites[i].source, WHITE);
+        }
+        UnloadImage (images[i]);
+    }
+
+    if (size == 0) *count = 0;
+
+    return atlas;
+}
+
+// Loads and packs the inputs of one atlas into one image, fills sprites and count
+static Image BuildAtlasImage (AtlasGroup group, AtlasSprite *sprites, int *count)
+{
+    Image images[ATLAS_MAX_SPRITES];
+    *count = LoadAtlasImages (group, sprites, images);
+
+    return ComposeAtlasImage (sprites, images, count);
+}
+
+// Writes the lookup table text for a packed atlas, table must hold ATLAS_TABLE_BYTES
+static void FormatAtlasTable (char *table, const AtlasSprite *sprites, int count, int width, int height)
+{
+    int length = snprintf (table, ATLAS_TABLE_BYTES, "atlas %d %d\n", width, height);
+
+    for (int i = 0; i < count; i++)
+    {
+        Rectangle r = sprites[i].source;
+        length += snprintf (table + length, ATLAS_TABLE_BYTES - length, "%s %d %d %d %d\n",
+                            sprites[i].name, (int)r.x, (int)r.y, (int)r.width, (int)r.height);
+    }
+}
+
+// Reads a lookup table into atlas, returns false if it has no header
+static bool ParseAtlasTable (SpriteAtlas *atlas, const char *table, int *width, int *height)
+{
+    const char *line = table;
+    atlas->count = 0;
+
+    if (sscanf (line, "atlas %d %d", width, height) != 2) return false;
+
+    while ((line = strchr (line, '\n')) != NULL && atlas->count < ATLAS_MAX_SPRITES)
+    {
+        line++;
+
+        AtlasSprite *sprite = &atlas->sprites[atlas->count];
+        int x, y, w, h;
+        if (sscanf (line, "%31s %d %d %d %d", sprite->name, &x, &y, &w, &h) != 5) continue;
+
+        sprite->source = (Rectangle){ (float)x, (float)y, (float)w, (float)h };
+        atlas->count++;
+    }
+
+    return true;
+}
+
+// Offline step: writes <basePath>_<group>.png and the <basePath>_<group>.atlas lookup table for every group
+static bool ExportSpriteAtlas (const char *basePath)
+{
+    bool exported = true;
+
+    MakeDirectory (GetDirectoryPath (basePath));
+
+    for (int group = 0; group < ATLAS_GROUP_COUNT; group++)
+    {
+        AtlasSprite sprites[ATLAS_MAX_SPRITES];
+        int count = 0;
+        Image atlas = BuildAtlasImage (group, sprites, &count);
+
+        char table[ATLAS_TABLE_BYTES];
+        FormatAtlasTable (table, sprites, count, atlas.width, atlas.height);
+
+        const char *groupPath = TextFormat ("%s_%s", basePath, atlasGroupNames[group]);
+        bool written = count > 0 &&
+                       ExportImage (atlas, TextFormat ("%s.png", groupPath)) &&
+                       SaveFileText (TextFormat ("%s.atlas", groupPath), table);
+        UnloadImage (atlas);
+
+        if (written) TraceLog (LOG_INFO, "ATLAS: Packed %d images into %s.png", count, groupPath);
+        exported = exported && written;
+    }
+
+    return exported;
+}
+
+static void UnloadSpriteAtlas (SpriteAtlas *atlas)
+{
+    if (atlas->texture.id > 0) UnloadTexture (atlas->texture);
+}
+
+// Source rectangle in atlas pixels, empty if the atlas has no such sprite
+static Rectangle GetAtlasSprite (const SpriteAtlas *atlas, const char *name)
+{
+    for (int i = 0; i < atlas->count; i++)
+    {
+        if (strcmp (atlas->sprites[i].name, name) == 0) return atlas->sprites[i].source;
+    }
+
+    TraceLog (LOG_WARNING, "ATLAS: No sprite named %s", name);
+    return (Rectangle){ 0 };
+}
+
+// Same area in normalized texture coordinates, as the sprite batch wants it
+static Rectangle GetAtlasUV (const SpriteAtlas *atlas, const char *name)
+{
+    Rectangle source = GetAtlasSprite (atlas, name);
+    float width = (float)atlas->texture.width;
+    float height = (float)atlas->texture.height;
+
+    return (Rectangle){ source.x / width, source.y / height, source.width / width, source.height / height };
+}
+
+// Asset pack
+
+// Places the payload after offset, the entry must already be named
+static size_t AddPackEntry (unsigned char *data, size_t offset, PackEntry *entry, const void *payload, size_t size)
+{
+    offset = (offset + PACK_ALIGN - 1) & ~(size_t)(PACK_ALIGN - 1);
+
+    entry->offset = offset;
+    entry->size = size;
+    if (data != NULL) memcpy (data + offset, payload, size);
+
+    return offset + size;
+}
+
+// Offline step: converts the atlases and the window icon to raw pixels and writes them as one pack
+static bool BuildAssetPack (const char *path)
+{
+    // The icon, then an image and a lookup table per atlas group
+    Image images[1 + ATLAS_GROUP_COUNT];
+    char tables[ATLAS_GROUP_COUNT][ATLAS_TABLE_BYTES];
+    PackEntry entries[1 + 2*ATLAS_GROUP_COUNT] = { 0 };
+    int entryCount = 1 + 2*ATLAS_GROUP_COUNT;
+    bool complete = true;
+
+    images[0] = LoadImage ("resources/images/icon.png");
+    if (images[0].data != NULL) ImageFormat (&images[0], PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    snprintf (entries[0].name, PACK_NAME_BYTES, "icon");
+    complete = images[0].data != NULL;
+
+    for (int group = 0; group < ATLAS_GROUP_COUNT; group++)
+    {
+        AtlasSprite sprites[ATLAS_MAX_SPRITES];
+        int count = 0;
+        Image *atlas = &images[1 + group];
+
+        *atlas = BuildAtlasImage (group, sprites, &count);
+        FormatAtlasTable (tables[group], sprites, count, atlas->width, atlas->height);
+        snprintf (entries[1 + group].name, PACK_NAME_BYTES, "atlas.%s", atlasGroupNames[group]);
+        snprintf (entries[1 + ATLAS_GROUP_COUNT + group].name, PACK_NAME_BYTES, "atlas.%s.table", atlasGroupNames[group]);
+        complete = complete && count > 0;
+    }
+
+    // First pass sizes the file, second pass fills it
+    unsigned char *data = NULL;
+    size_t size = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t offset = sizeof (PackHeader) + entryCount*sizeof (PackEntry);
+
+        for (int i = 0; i < 1 + ATLAS_GROUP_COUNT; i++)
+        {
+            entries[i].kind = PACK_ENTRY_IMAGE;
+            entries[i].width = images[i].width;
+            entries[i].height = images[i].height;
+            entries[i].format = images[i].format;
+            offset = AddPackEntry (data, offset, &entries[i], images[i].data,
+                                   GetPixelDataSize (images[i].width, images[i].height, images[i].format));
+        }
+
+        for (int group = 0; group < ATLAS_GROUP_COUNT; group++)
+        {
+            PackEntry *entry = &entries[1 + ATLAS_GROUP_COUNT + group];
+            entry->kind = PACK_ENTRY_TEXT;
+            offset = AddPackEntry (data, offset, entry, tables[group], strlen (tables[group]) + 1);
+        }
+
+        if (pass == 0)
+        {
+            size = offset;
+            data = MemAlloc ((unsigned int)size);
+        }
+    }
+
+    PackHeader header = { PACK_MAGIC, PACK_VERSION, (uint32_t)entryCount, 0 };
+    memcpy (data, &header, sizeof (header));
+    memcpy (data + sizeof (header), entries, sizeof (entries));
+
+    MakeDirectory (GetDirectoryPath (path));
+    bool saved = complete && SaveFileData (path, data, (int)size);
+
+    if (saved) TraceLog (LOG_INFO, "PACK: Wrote %d entries, %zu bytes to %s", entryCount, size, path);
+    else TraceLog (LOG_WARNING, "PACK: Failed to build %s", path);
+
+    MemFree (data);
+    for (int i = 0; i < 1 + ATLAS_GROUP_COUNT; i++) UnloadImage (images[i]);
+
+    return saved;
+}
+
+static void CloseAssetPack (AssetPack *pack)
+{
+#if defined(PACK_USE_MMAP)
+    if (pack->mapped) munmap (pack->data, pack->size);
+#endif
+    if (!pack->mapped && pack->data != NULL) UnloadFileData (pack->data);
+
+    *pack = (AssetPack){ 0 };
+}
+
+// Maps the pack and checks the index. Returns false, with nothing left open, if it is missing or malformed.
+static bool OpenAssetPack (AssetPack *pack, const char *path)
+{
+    *pack = (AssetPack){ 0 };
+
+#if defined(PACK_USE_MMAP)
+    int file = open (path, O_RDONLY);
+    if (file < 0) return false;
+
+    struct stat info;
+    if (fstat (file, &info) == 0 && info.st_size > 0)
+    {
+        void *data = mmap (NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data != MAP_FAILED)
+        {
+            pack->data = data;
+            pack->size = (size_t)info.st_size;
+            pack->mapped = true;
+        }
+    }
+    close (file);
+#else
+    if (FileExists (path))
+    {
+        int size = 0;
+        pack->data = LoadFileData (path, &size);
+        pack->size = (size_t)size;
+    }
+#endif
+
+    if (pack->data == NULL) return false;
+
+    const PackHeader *header = (const PackHeader *)pack->data;
+    bool valid = pack->size >= sizeof (PackHeader) && header->magic == PACK_MAGIC && header->version == PACK_VERSION &&
+                 header->entryCount <= (pack->size - sizeof (PackHeader))/sizeof (PackEntry);
+
+    if (valid)
+    {
+        pack->entries = (const PackEntry *)(pack->data + sizeof (PackHeader));
+        pack->count = (int)header->entryCount;
+
+        for (int i = 0; i < pack->count && valid; i++)
+        {
+            const PackEntry *entry = &pack->entries[i];
+            valid = entry->offset <= pack->size && entry->size <= pack->size - entry->offset &&
+                    memchr (entry->name, '\0', PACK_NAME_BYTES) != NULL;
+
+            if (valid && entry->kind == PACK_ENTRY_IMAGE)
+            {
+                valid = entry->size == (uint64_t)GetPixelDataSize (entry->width, entry->height, entry->format);
+            }
+            else if (valid) valid = entry->size > 0 && pack->data[entry->offset + entry->size - 1] == '\0';
+        }
+    }
+
+    if (!valid)
+    {
+        TraceLog (LOG_WARNING, "PACK: %s is not a valid asset pack", path);
+        CloseAssetPack (pack);
+    }
+
+    return valid;
+}
+
+static const PackEntry *FindPackEntry (const AssetPack *pack, const char *name, PackEntryKind kind)
+{
+    for (int i = 0; i < pack->count; i++)
+    {
+        if (pack->entries[i].kind == kind && strcmp (pack->entries[i].name, name) == 0) return &pack->entries[i];
+    }
+
+    return NULL;
+}
+
+// The image points into the pack: upload it or hand it to raylib, never UnloadImage it
+static Image GetPackImage (const AssetPack *pack, const char *name)
+{
+    const PackEntry *entry = FindPackEntry (pack, name, PACK_ENTRY_IMAGE);
+    if (entry == NULL) return (Image){ 0 };
+
+    return (Image){ pack->data + entry->offset, (int)entry->width, (int)entry->height, 1, (int)entry->format };
+}
+
+static const char *GetPackText (const AssetPack *pack, const char *name)
+{
+    const PackEntry *entry = FindPackEntry (pack, name, PACK_ENTRY_TEXT);
+    return entry ? (const char *)(pack->data + entry->offset) : NULL;
+}
+
+// Asset loading
+
+// Runs on the worker that finishes the last job, turns the decoded images into the icon and the atlas image
+static void ComposeLoadedAssets (AssetLoader *loader)
+{
+    int firstAtlasJob = loader->withIcon ? 1 : 0;
+    if (loader->withIcon) loader->icon = loader->images[0];
+
+    if (loader->fromAtlasFiles)
+    {
+        // TextFormat is not safe off the main thread
+        char path[LOADER_PATH_BYTES + 8];
+        snprintf (path, sizeof (path), "%s.atlas", loader->atlasPath);
+
+        char *table = LoadFileText (path);
+        Image image = loader->images[firstAtlasJob];
+        int width = 0;
+        int height = 0;
+        bool valid = table != NULL && ParseAtlasTable (&loader->atlas, table, &width, &height) &&
+                     image.data != NULL && width == image.width && height == image.height;
+        if (table != NULL) UnloadFileText (table);
+
+        if (valid)
+        {
+            loader->atlasImage = image;
+            return;
+        }
+
+        TraceLog (LOG_WARNING, "ATLAS: %s does not match its lookup table, packing the loose images", loader->atlasPath);
+        UnloadImage (image);
+        loader->atlasImage = BuildAtlasImage (loader->group, loader->atlas.sprites, &loader->atlas.count);
+        return;
+    }
+
+    Image images[ATLAS_MAX_SPRITES];
+    int count = (loader->group == ATLAS_GAME) ? GenAtlasShapes (loader->atlas.sprites, images) : 0;
+
+    for (int job = firstAtlasJob; job < loader->jobCount && count < ATLAS_MAX_SPRITES; job++)
+    {
+        if (loader->images[job].data == NULL) continue;
+
+        images[count] = loader->images[job];
+        strncpy (loader->atlas.sprites[count].name, loader->names[job], ATLAS_NAME_BYTES - 1);
+        count++;
+    }
+
+    loader->atlas.count = count;
+    loader->atlasImage = ComposeAtlasImage (loader->atlas.sprites, images, &loader->atlas.count);
+}
+
+static void *RunAssetWorker (void *data)
+{
+    AssetLoader *loader = data;
+
+    for (;;)
+    {
+        int job = atomic_fetch_add (&loader->nextJob, 1);
+        if (job >= loader->jobCount) break;
+
+        loader->images[job] = LoadImage (loader->paths[job]);
+        if (loader->images[job].data != NULL) ImageFormat (&loader->images[job], PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+
+        // The last one done sees every other job's image through the counter
+        if (atomic_fetch_add (&loader->finishedJobs, 1) + 1 == loader->jobCount)
+        {
+            ComposeLoadedAssets (loader);
+            atomic_store (&loader->decoded, true);
+        }
+    }
+
+    return NULL;
+}
+
+// Returns right away, the work happens on the workers and in UpdateAssetLoader
+static void StartAssetLoader (AssetLoader *loader, AtlasGroup group, bool withIcon, const char *packPath)
+{
+    memset (loader, 0, sizeof (*loader));
+    atomic_init (&loader->nextJob, 0);
+    atomic_init (&loader->finishedJobs, 0);
+    atomic_init (&loader->decoded, false);
+    loader->group = group;
+    loader->withIcon = withIcon;
+
+    // A mapped pack has nothing to decode, its pixels are uploaded as they are
+    loader->packed = packPath != NULL && OpenAssetPack (&loader->pack, packPath);
+
+    if (loader->packed)
+    {
+        const char *table = GetPackText (&loader->pack, TextFormat ("atlas.%s.table", atlasGroupNames[group]));
+        int width = 0;
+        int height = 0;
+
+        if (withIcon) loader->icon = GetPackImage (&loader->pack, "icon");
+        loader->atlasImage = GetPackImage (&loader->pack, TextFormat ("atlas.%s", atlasGroupNames[group]));
+
+        if (loader->atlasImage.data != NULL && table != NULL && ParseAtlasTable (&loader->atlas, table, &width, &height) &&
+            width == loader->atlasImage.width && height == loader->atlasImage.height)
+        {
+            atomic_store (&loader->decoded, true);
+            return;
+        }
+
+        TraceLog (LOG_WARNING, "PACK: %s has no usable %s atlas", packPath, atlasGroupNames[group]);
+        CloseAssetPack (&loader->pack);
+        loader->packed = false;
+        loader->icon = (Image){ 0 };
+        loader->atlasImage = (Image){ 0 };
+    }
+
+    if (withIcon) loader->paths[loader->jobCount++] = "resources/images/icon.png";
+
+    snprintf (loader->atlasPath, LOADER_PATH_BYTES, "%s_%s", ATLAS_PATH, atlasGroupNames[group]);
+    loader->fromAtlasFiles = FileExists (TextFormat ("%s.atlas", loader->atlasPath));
+
+    if (loader->fromAtlasFiles)
+    {
+        snprintf (loader->atlasImagePath, LOADER_PATH_BYTES, "%s_%s.png", ATLAS_PATH, atlasGroupNames[group]);
+        loader->paths[loader->jobCount++] = loader->atlasImagePath;
+    }
+    else
+    {
+        for (int i = 0; i < ATLAS_IMAGE_COUNT && loader->jobCount < LOADER_MAX_JOBS; i++)
+        {
+            if (atlasImages[i].group != group) continue;
+
+            loader->names[loader->jobCount] = atlasImages[i].name;
+            loader->paths[loader->jobCount++] = atlasImages[i].path;
+        }
+    }
+
+    // Generated shapes only, the composing step still runs once
+    if (loader->jobCount == 0)
+    {
+        ComposeLoadedAssets (loader);
+        atomic_store (&loader->decoded, true);
+        return;
+    }
+
+    for (int i = 0; i < LOADER_WORKERS && i < loader->jobCount; i++)
+    {
+        if (pthread_create (&loader->workers[loader->workerCount], NULL, RunAssetWorker, loader) == 0) loader->workerCount++;
+    }
+
+    // Still loads without threads, just not in the background
+    if (loader->workerCount == 0) RunAssetWorker (loader);
+}
+
+// Joins the workers and frees the staging images, a finished atlas stays. Safe to call more than once.
+static void ReleaseAssetLoader (AssetLoader *loader)
+{
+    for (int i = 0; i < loader->workerCount; i++) pthread_join (loader->workers[i], NULL);
+    loader->workerCount = 0;
+
+    if (!atomic_load (&loader->decoded)) return;
+
+    if (loader->packed) CloseAssetPack (&loader->pack);
+    else
+    {
+        UnloadImage (loader->icon);
+        UnloadImage (loader->atlasImage);
+    }
+
+    loader->packed = false;
+    loader->icon = (Image){ 0 };
+    loader->atlasImage = (Image){ 0 };
+
+    // Released halfway through the upload
+    if (!loader->finished && loader->atlas.texture.id > 0)
+    {
+        UnloadTexture (loader->atlas.texture);
+        loader->atlas.texture = (Texture2D){ 0 };
+    }
+}
+
+// Main thread, once per frame: uploads the next slice of the atlas once decoding is done.
+// Returns true once, when loader->atlas is ready to use.
+static bool UpdateAssetLoader (AssetLoader *loader)
+{
+    if (loader->finished || !atomic_load (&loader->decoded)) return false;
+
+    Image image = loader->atlasImage;
+
+    if (loader->atlas.texture.id == 0)
+    {
+        // Storage only, the pixels follow in slices
+        loader->atlas.texture = LoadTextureFromImage ((Image){ NULL, image.width, image.height, 1, image.format });
+        return false;
+    }
+
+    int rowBytes = GetPixelDataSize (image.width, 1, image.format);
+    int rows = Clamp (LOADER_UPLOAD_BYTES / rowBytes, 1, image.height - loader->uploadedRows);
+
+    if (loader->uploadedRows < image.height)
+    {
+        Rectangle slice = { 0.0f, (float)loader->uploadedRows, (float)image.width, (float)rows };
+        UpdateTextureRec (loader->atlas.texture, slice, (unsigned char *)image.data + (size_t)loader->uploadedRows*rowBytes);
+        loader->uploadedRows += rows;
+        return false;
+    }
+
+    if (loader->withIcon) SetWindowIcon (loader->icon);
+
+    loader->finished = true;
+    ReleaseAssetLoader (loader);
+
+    return true;
+}
+
+// Decoding and uploading count half each
+static float GetAssetLoaderProgress (AssetLoader *loader)
+{
+    if (loader->finished) return 1.0f;
+    if (!atomic_load (&loader->decoded)) return 0.5f*atomic_load (&loader->finishedJobs) / (float)loader->jobCount;
+    if (loader->atlasImage.height == 0) return 1.0f;
+
+    return 0.5f + 0.5f*loader->uploadedRows / (float)loader->atlasImage.height;
+}
+
+// Resident atlases
+
+// packPath NULL loads the loose images
+static void InitGameResources (GameResources *resources, const char *packPath)
+{
+    memset (resources, 0, sizeof (*resources));
+    resources->packPath = packPath;
+}
+
+// Starts loading the groups in mask that are missing, releases the ones outside it
+static void RequestResources (GameResources *resources, unsigned int mask)
+{
+    for (int group = 0; group < ATLAS_GROUP_COUNT; group++)
+    {
+        bool wanted = (mask & ATLAS_BIT (group)) != 0;
+        bool resident = resources->atlas[group].texture.id > 0;
+
+        if (wanted && !resident && !resources->loading[group])
+        {
+            StartAssetLoader (&resources->loaders[group], group, !resources->iconRequested, resources->packPath);
+            resources->loading[group] = true;
+            resources->iconRequested = true;
+        }
+        else if (!wanted && resources->loading[group])
+        {
+            ReleaseAssetLoader (&resources->loaders[group]);
+            resources->loading[group] = false;
+        }
+        else if (!wanted && resident)
+        {
+            UnloadSpriteAtlas (&resources->atlas[group]);
+            resources->atlas[group] = (SpriteAtlas){ 0 };
+            TraceLog (LOG_INFO, "RESOURCES: Released the %s atlas", atlasGroupNames[group]);
+        }
+    }
+}
+
+// Moves the loads along, once per frame
+static void UpdateResources (GameResources *resources)
+{
+    for (int group = 0; group < ATLAS_GROUP_COUNT; group++)
+    {
+        if (!resources->loading[group] || !UpdateAssetLoader (&resources->loaders[group])) continue;
+
+        resources->atlas[group] = resources->loaders[group].atlas;
+        resources->loading[group] = false;
+        TraceLog (LOG_INFO, "RESOURCES: Loaded the %s atlas", atlasGroupNames[group]);
+    }
+}
+
+static bool ResourcesReady (const GameResources *resources, unsigned int mask)
+{
+    for (int group = 0; group < ATLAS_GROUP_COUNT; group++)
+    {
+        if ((mask & ATLAS_BIT (group)) && resources->atlas[group].texture.id == 0) return false;
+    }
+
+    return true;
+}
+
+// A worker finishing its decode is no input event, screens waiting for one would hold the upload back
+static bool IsLoadingResources (const GameResources *resources)
+{
+    for (int group = 0; group < ATLAS_GROUP_COUNT; group++)
+    {
+        if (resources->loading[group]) return true;
+    }
+
+    return false;
+}
+
+static float GetResourcesProgress (GameResources *resources, unsigned int mask)
+{
+    float progress = 0.0f;
+    int count = 0;
+
+    for (int group = 0; group < ATLAS_GROUP_COUNT; group++)
+    {
+        if (!(mask & ATLAS_BIT (group))) continue;
+
+        progress += resources->loading[group] ? GetAssetLoaderProgress (&resources->loaders[group]) : 1.0f;
+        count++;
+    }
+
+    return count > 0 ? progress / count : 1.0f;
+}
+
+static void UnloadGameResources (GameResources *resources)
+{
+    RequestResources (resources, 0);
+}
+
+// Sprite batch
+
+static void InitSpriteBatch (SpriteBatch *batch, int capacity)
+{
+    int vertexCount = capacity*6;
+
+    batch->mesh = (Mesh){ 0 };
+    batch->mesh.vertexCount = vertexCount;
+    batch->mesh.triangleCount = capacity*2;
+    batch->mesh.vertices = MemAlloc (vertexCount*3*sizeof (float));
+    batch->mesh.texcoords = MemAlloc (vertexCount*2*sizeof (float));
+    batch->mesh.colors = MemAlloc (vertexCount*4*sizeof (unsigned char));
+    UploadMesh (&batch->mesh, true);
+
+    batch->material = LoadMaterialDefault ();
+    batch->defaultTexture = batch->material.maps[MATERIAL_MAP_DIFFUSE].texture;
+
+    batch->capacity = capacity;
+    batch->count = 0;
+    batch->drawCalls = 0;
+    batch->vertices = 0;
+    batch->peakDrawCalls = 0;
+    batch->peakVertices = 0;
+}
+
+// Binds the atlas every quad samples, the batch does not take ownership of it
+static void SetSpriteBatchTexture (SpriteBatch *batch, Texture2D texture)
+{
+    batch->material.maps[MATERIAL_MAP_DIFFUSE].texture = texture;
+}
+
+static void UnloadSpriteBatch (SpriteBatch *batch)
+{
+    batch->material.maps[MATERIAL_MAP_DIFFUSE].texture = batch->defaultTexture;
+    UnloadMesh (batch->mesh);
+    UnloadMaterial (batch->material);
+}
+
+// Uploads the pending quads and draws them with one draw call
+static void FlushSpriteBatch (SpriteBatch *batch)
+{
+    if (batch->count == 0) return;
+
+    int vertexCount = batch->count*6;
+    UpdateMeshBuffer (batch->mesh, 0, batch->mesh.vertices, vertexCount*3*sizeof (float), 0);
+    UpdateMeshBuffer (batch->mesh, 1, batch->mesh.texcoords, vertexCount*2*sizeof (float), 0);
+    UpdateMeshBuffer (batch->mesh, 3, batch->mesh.colors, vertexCount*4*sizeof (unsigned char), 0);
+
+    // Only draw the part of the buffer filled this time
+    Mesh mesh = batch->mesh;
+    mesh.vertexCount = vertexCount;
+    mesh.triangleCount = batch->count*2;
+    DrawMesh (mesh, batch->material, MatrixIdentity ());
+
+    batch->drawCalls++;
+    batch->vertices += vertexCount;
+    batch->count = 0;
+
+    if (batch->drawCalls > batch->peakDrawCalls) batch->peakDrawCalls = batch->drawCalls;
+    if (batch->vertices > batch->peakVertices) batch->peakVertices = batch->vertices;
+}
+
+static void BeginSpriteBatch (SpriteBatch *batch)
+{
+    batch->count = 0;
+    batch->drawCalls = 0;
+    batch->vertices = 0;
+}
+
+// Queues a quad, source is in normalized atlas coordinates
+static void PushSprite (SpriteBatch *batch, Rectangle dest, Rectangle source, Color color)
+{
+    if (batch->count == batch->capacity) FlushSpriteBatch (batch);
+
+    // Two triangles, same winding as raylib's own quads: top-left, bottom-left, bottom-right, top-right
+    const float x[4] = { dest.x, dest.x, dest.x + dest.width, dest.x + dest.width };
+    const float y[4] = { dest.y, dest.y + dest.height, dest.y + dest.height, dest.y };
+    const float u[4] = { source.x, source.x, source.x + source.width, source.x + source.width };
+    const float v[4] = { source.y, source.y + source.height, source.y + source.height, source.y };
+    static const int corner[6] = { 0, 1, 2, 0, 2, 3 };
+
+    int first = batch->count*6;
+    for (int i = 0; i < 6; i++)
+    {
+        int k = first + i;
+        batch->mesh.vertices[k*3 + 0] = x[corner[i]];
+        batch->mesh.vertices[k*3 + 1] = y[corner[i]];
+        batch->mesh.vertices[k*3 + 2] = 0.0f;
+        batch->mesh.texcoords[k*2 + 0] = u[corner[i]];
+        batch->mesh.texcoords[k*2 + 1] = v[corner[i]];
+        batch->mesh.colors[k*4 + 0] = color.r;
+        batch->mesh.colors[k*4 + 1] = color.g;
+        batch->mesh.colors[k*4 + 2] = color.b;
+        batch->mesh.colors[k*4 + 3] = color.a;
+    }
+
+    batch->count++;
+}
+
+// Spatial grid and view culling
+
+static inline int GridCell (float v)
+{
+    return (int)floorf (v / GRID_CELL_SIZE);
+}
+
+static inline int GridBucket (int cellX, int cellY)
+{
+    return (int)(((unsigned int)cellX*73856093u ^ (unsigned int)cellY*19349663u) & (GRID_BUCKETS - 1));
+}
+
+static void AddGridEntry (SpatialGrid *grid, Rectangle bounds, ComponentId kind, int type, unsigned char alpha)
+{
+    GridEntry *entry = &grid->unsorted[grid->count++];
+
+    entry->bounds = bounds;
+    entry->cellX = GridCell (bounds.x + bounds.width/2.0f);
+    entry->cellY = GridCell (bounds.y + bounds.height/2.0f);
+    entry->kind = (unsigned char)kind;
+    entry->type = (unsigned char)type;
+    entry->alpha = alpha;
+    grid->bucketStart[GridBucket (entry->cellX, entry->cellY) + 1]++;
+}
+
+// Rebuilds the grid from every bullet, enemy and spark, a counting sort so the cost is linear in the entity count
+static void BuildSpatialGrid (SpatialGrid *grid, World *world)
+{
+    ChunkView view;
+
+    grid->count = 0;
+    memset (grid->bucketStart, 0, sizeof (grid->bucketStart));
+
+    for (Query q = BeginQuery (BULLET_COMPONENTS); NextChunk (world, &q, &view); )
+    {
+        const BulletTypeDef *def = &bulletTypes[view.type];
+        Vector2 *position = view.component[COMPONENT_POSITION];
+
+        for (int i = 0; i < view.count; i++)
+        {
+            Rectangle bounds = { position[i].x - def->radius, position[i].y - def->radius, def->radius*2.0f, def->radius*2.0f };
+            AddGridEntry (grid, bounds, COMPONENT_BULLET, view.type, 255);
+        }
+    }
+
+    for (Query q = BeginQuery (ENEMY_COMPONENTS); NextChunk (world, &q, &view); )
+    {
+        const EnemyTypeDef *def = &enemyTypes[view.type];
+        Vector2 *position = view.component[COMPONENT_POSITION];
+
+        for (int i = 0; i < view.count; i++)
+        {
+            AddGridEntry (grid, (Rectangle){ position[i].x, position[i].y, def->width, def->height }, COMPONENT_ENEMY, view.type, 255);
+        }
+    }
+
+    for (Query q = BeginQuery (PARTICLE_COMPONENTS); NextChunk (world, &q, &view); )
+    {
+        Vector2 *position = view.component[COMPONENT_POSITION];
+        float *life = view.component[COMPONENT_LIFE];
+
+        for (int i = 0; i < view.count; i++)
+        {
+            Rectangle bounds = { position[i].x - PARTICLE_SIZE/2.0f, position[i].y - PARTICLE_SIZE/2.0f, PARTICLE_SIZE, PARTICLE_SIZE };
+            AddGridEntry (grid, bounds, COMPONENT_PARTICLE, view.type, (unsigned char)(255.0f * life[i] / PARTICLE_LIFE));
+        }
+    }
+
+    for (int b = 0; b < GRID_BUCKETS; b++) grid->bucketStart[b + 1] += grid->bucketStart[b];
+
+    // Scatter in reverse so entries keep their insertion order inside a bucket
+    static int fill[GRID_BUCKETS + 1];
+    memcpy (fill, grid->bucketStart, sizeof (fill));
+    for (int i = 0; i < grid->count; i++)
+    {
+        const GridEntry *entry = &grid->unsorted[i];
+        grid->entries[fill[GridBucket (entry->cellX, entry->cellY)]++] = *entry;
+    }
+}
+
+// Fills the visible set with every entry overlapping the rectangle
+static void CullSpatialGrid (const SpatialGrid *grid, Rectangle view, VisibleSet *visible)
+{
+    visible->count = 0;
+
+    // Entries live in the cell of their centre, one cell of margin catches the ones poking into the view
+    int minX = GridCell (view.x) - 1;
+    int minY = GridCell (view.y) - 1;
+    int maxX = GridCell (view.x + view.width) + 1;
+    int maxY = GridCell (view.y + view.height) + 1;
+
+    for (int cy = minY; cy <= maxY; cy++)
+    {
+        for (int cx = minX; cx <= maxX; cx++)
+        {
+            int bucket = GridBucket (cx, cy);
+
+            for (int i = grid->bucketStart[bucket]; i < grid->bucketStart[bucket + 1]; i++)
+            {
+                const GridEntry *entry = &grid->entries[i];
+
+                // Buckets are shared between cells, only take the entries of this cell so nothing is drawn twice
+                if (entry->cellX != cx || entry->cellY != cy) continue;
+
+                if (CheckCollisionRecs (entry->bounds, view)) visible->index[visible->count++] = i;
+            }
+        }
+    }
+
+    visible->culled = grid->count - visible->count;
+}
+
+// World rectangle seen through the camera
+static Rectangle GetCameraView (Camera2D camera, float width, float height)
+{
+    Vector2 topLeft = GetScreenToWorld2D ((Vector2){ 0.0f, 0.0f }, camera);
+    Vector2 bottomRight = GetScreenToWorld2D ((Vector2){ width, height }, camera);
+
+    return (Rectangle){ topLeft.x, topLeft.y, bottomRight.x - topLeft.x, bottomRight.y - topLeft.y };
+}
+
+// Wave spawner
+
+static void ResetWaveSpawner (WaveSpawner *spawner)
+{
+    spawner->wave = 0;
+    spawner->spawned = 0;
+    spawner->timer = -waves[0].delay;
+    spawner->dropped = 0;
+}
+
+// Random point on the wave's spawn ring
+static Vector2 GetWaveSpawnPosition (const WaveDef *wave, Vector2 center)
+{
+    float angle = GetRandomValue (0, 3599) * (PI / 1800.0f);
+    float radius = wave->ringMin + (wave->ringMax - wave->ringMin) * (GetRandomValue (0, 1000) / 1000.0f);
+
+    return (Vector2){ center.x + cosf (angle) * radius, center.y + sinf (angle) * radius };
+}
+
+// Spawns whatever the current wave owes for this tick, the cost only depends on how many enemies come out
+static void UpdateWaveSpawner (WaveSpawner *spawner, World *world, Vector2 center, float dt)
+{
+    if (spawner->wave >= WAVE_COUNT) return;
+
+    spawner->timer += dt;
+
+    while (spawner->wave < WAVE_COUNT && spawner->timer >= 0.0f)
+    {
+        const WaveDef *wave = &waves[spawner->wave];
+        int owed = wave->count - spawner->spawned;
+
+        if (wave->interval > 0.0f)
+        {
+            int due = (int)(spawner->timer / wave->interval) + 1;
+            if (due < owed) owed = due;
+        }
+
+        for (int i = 0; i < owed; i++)
+        {
+            if (SpawnEnemy (world, wave->type, GetWaveSpawnPosition (wave, center)) == HANDLE_NONE) spawner->dropped++;
+        }
+
+        spawner->spawned += owed;
+        spawner->timer -= (wave->interval > 0.0f) ? owed * wave->interval : spawner->timer;
+
+        if (spawner->spawned < wave->count) break;
+
+        // Wave finished, the next one starts after its delay
+        spawner->wave++;
+        spawner->spawned = 0;
+        if (spawner->wave < WAVE_COUNT) spawner->timer -= waves[spawner->wave].delay;
+    }
+}
+
+
+// Simulation thread
+
+// Fills the producer's slot from the current state and swaps it into the middle
+static void PublishSnapshot (Simulation *sim, float tickTime)
+{
+    FrameSnapshot *snapshot = &sim->slots[sim->writing];
+
+    BuildSpatialGrid (sim->grid, sim->world);
+    CullSpatialGrid (sim->grid, sim->view, sim->visible);
+
+    for (int i = 0; i < sim->visible->count; i++)
+    {
+        const GridEntry *entry = &sim->grid->entries[sim->visible->index[i]];
+        snapshot->sprites[i] = (SnapshotSprite){ entry->bounds, entry->kind, entry->type, entry->alpha };
+    }
+
+    snapshot->tick = sim->tick;
+    snapshot->spriteCount = sim->visible->count;
+    snapshot->culled = sim->visible->culled;
+
+    snapshot->player = sim->player->rect;
+    snapshot->hud = (HudValues){ sim->player->health, sim->player->maxHealth, sim->player->dollars, sim->player->weapon };
+    snapshot->enemies = CountEntities (sim->world, COMPONENT_BIT (COMPONENT_ENEMY));
+    snapshot->bullets = CountEntities (sim->world, COMPONENT_BIT (COMPONENT_BULLET));
+    snapshot->particles = CountEntities (sim->world, COMPONENT_BIT (COMPONENT_PARTICLE));
+    snapshot->droppedShots = sim->player->droppedShots;
+    snapshot->playerDead = sim->player->health <= 0;
+    snapshot->tickTime = tickTime;
+
+    sim->writing = atomic_exchange (&sim->middle, sim->writing | SNAPSHOT_FRESH) & SNAPSHOT_SLOT_MASK;
+}
+
+// Latest finished snapshot, stays valid until the next call
+static const FrameSnapshot *AcquireSnapshot (Simulation *sim)
+{
+    if (atomic_load (&sim->middle) & SNAPSHOT_FRESH)
+    {
+        sim->reading = atomic_exchange (&sim->middle, sim->reading) & SNAPSHOT_SLOT_MASK;
+    }
+
+    return &sim->slots[sim->reading];
+}
+
+// Places shots in time inside the tick [0, dt]: a click fires once the weapon is ready, holding an automatic
+// weapon keeps firing at its rate from the last click on. Emits however many shots that makes, even several
+// per tick, each advanced by the time between it and the end of the tick.
+static void UpdateFireScheduler (Player *player, World *world, const SimInput *input, Vector2 origin)
+{
+    // A click queued for the old weapon is not fired by the new one
+    if (input->weapon >= 0 && input->weapon != (int)player->weapon)
+    {
+        player->weapon = input->weapon;
+        player->shotQueued = false;
+    }
+
+    const WeaponDef *weapon = &weapons[player->weapon];
+    float interval = 1.0f / weapon->fireRate;
+    float dt = input->dt;
+    float next = player->nextShot;
+    float holdStart = 0.0f;
+
+    // Clicks are stamped with the poll that delivered them, so two of them can land closer than the fire
+    // interval even if they were not. A click while the weapon is still cycling fires as soon as it is ready,
+    // in the next tick if that is where it falls. Only one waits at a time, a newer click takes its place so
+    // the shot goes where the player aims now. A click carried over from the last tick comes first.
+    int queued = player->shotQueued ? 1 : 0;
+    bool carried = false;
+    Vector2 carriedAim = { 0 };
+
+    for (int i = 0; i < queued + input->clickCount; i++)
+    {
+        float time = (i < queued) ? 0.0f : dt - input->clickAge[i - queued];
+        Vector2 aim = (i < queued) ? player->queuedAim : input->clickAim[i - queued];
+        float shot = fmaxf (time, next);
+
+        if (shot <= dt)
+        {
+            FireWeapon (world, weapon, origin, aim, dt - shot);
+            next = shot + interval;
+        }
+        else
+        {
+            if (carried) player->droppedShots++;
+            carried = true;
+            carriedAim = aim;
+        }
+
+        if (i >= queued) holdStart = time;
+    }
+
+    player->shotQueued = carried;
+    player->queuedAim = carriedAim;
+
+    if (weapon->automatic && input->triggerHeld)
+    {
+        for (float time = fmaxf (next, holdStart); time <= dt; time = next)
+        {
+            FireWeapon (world, weapon, origin, input->aim, dt - time);
+            next = time + interval;
+        }
+    }
+
+    player->nextShot = fmaxf (next - dt, 0.0f);
+}
+
+// One gameplay tick, the same steps the update used to run inline
+static void SimulateTick (Simulation *sim, const SimInput *input)
+{
+    double start = GetWallTime ();
+    Player *player = sim->player;
+    World *world = sim->world;
+    float dt = input->dt;
+
+    // Player centre, useful for managing aim e bullet shooting logic
+    Vector2 playerCenter = 
+    { 
+        player->position.x + PLAYER_WIDTH/2.0f, 
+        player->position.y + PLAYER_HEIGHT/2.0f 
+    };
+
+    ChunkView view;
+
+    // Move bullets and destroy the ones that have left the screen boundaries
+    // We include the radius to ensure it's completely out of sight before destroying it
+    for (Query q = BeginQuery (BULLET_COMPONENTS); NextChunk (world, &q, &view); )
+    {
+        const BulletTypeDef *def = &bulletTypes[view.type];
+        float step = def->speed * dt;
+        Vector2 *position = view.component[COMPONENT_POSITION];
+        Vector2 *direction = view.component[COMPONENT_DIRECTION];
+
+        for (int i = 0; i < view.count; i++)
+        {
+            position[i].x += direction[i].x * step;
+            position[i].y += direction[i].y * step;
+
+            if (position[i].x < -def->radius || 
+            position[i].x > sim->screenWidth + def->radius ||
+            position[i].y < -def->radius || 
+            position[i].y > sim->screenHeight + def->radius) 
+            {
+                QueueDestroy (world, view.handle[i]);
+            }
+        }
+    }
+    FlushDestroyed (world);
+
+    // Shoot, every shot owed over the tick at its own time
+    UpdateFireScheduler (player, world, input, playerCenter);
+
+    // Check collision: Bullets vs Enemies
+    for (Query q = BeginQuery (BULLET_COMPONENTS); NextChunk (world, &q, &view); )
+    {
+        const BulletTypeDef *bulletDef = &bulletTypes[view.type];
+        Vector2 *position = view.component[COMPONENT_POSITION];
+
+        for (int i = 0; i < view.count; i++)
+        {
+            bool hit = false;
+            ChunkView target;
+
+            for (Query t = BeginQuery (ENEMY_COMPONENTS); !hit && NextChunk (world, &t, &target); )
+            {
+                const EnemyTypeDef *enemyDef = &enemyTypes[target.type];
+                Vector2 *enemyPosition = target.component[COMPONENT_POSITION];
+                int *health = target.component[COMPONENT_HEALTH];
+
+                for (int j = 0; j < target.count; j++)
+                {
+                    Rectangle rect = { enemyPosition[j].x, enemyPosition[j].y, enemyDef->width, enemyDef->height };
+
+                    // Skip enemies already killed this tick, check if the bullet circle overlaps the enemy rectangle
+                    if (health[j] > 0 && CheckCollisionCircleRec (position[i], bulletDef->radius, rect))
+                    {
+                        // 1. Subtract damage from enemy health
+                        health[j] -= bulletDef->damage;
+
+                        // 2. Check if enemy is dead
+                        if (health[j] <= 0)
+                        {
+                            player->dollars += enemyDef->bounty; // Reward the player!
+                            QueueDestroy (world, target.handle[j]);
+
+                            Vector2 enemyCenter = { enemyPosition[j].x + enemyDef->width/2.0f, enemyPosition[j].y + enemyDef->height/2.0f };
+                            SpawnSparks (world, target.type, enemyCenter);
+                        }
+
+                        hit = true;
+                        break; // Exit the enemy loop since the bullet is gone
+                    }
+                }
+            }
+
+            if (hit) QueueDestroy (world, view.handle[i]);
+        }
+    }
+    FlushDestroyed (world);
+
+    // Sparks fly and fade, the ones from this tick's kills start moving next tick
+    UpdateParticles (world, dt);
+
+    // Spawn the enemies owed by the current wave
+    UpdateWaveSpawner (sim->spawner, world, playerCenter, dt);
+
+    // Enemies chase the player
+    for (Query q = BeginQuery (ENEMY_COMPONENTS); NextChunk (world, &q, &view); )
+    {
+        const EnemyTypeDef *def = &enemyTypes[view.type];
+        float step = def->speed * dt;
+        Vector2 *position = view.component[COMPONENT_POSITION];
+        Vector2 *direction = view.component[COMPONENT_DIRECTION];
+
+        for (int i = 0; i < view.count; i++)
+        {
+            Vector2 enemyCenter = { position[i].x + def->width/2.0f, position[i].y + def->height/2.0f };
+            direction[i] = Vector2Normalize (Vector2Subtract (playerCenter, enemyCenter));
+            position[i].x += direction[i].x * step;
+            position[i].y += direction[i].y * step;
+        }
+    }
+
+    // Player movement
+    player->position.x += input->move.x * player->speed * dt;
+    player->position.y += input->move.y * player->speed * dt;
+
+    // Keep player inside the bounds
+    player->position = Vector2Clamp (player->position, sim->minBounds, sim->maxBounds);
+
+    // Player location on screen
+    player->rect.x = player->position.x;
+    player->rect.y = player->position.y;
+
+    sim->tick++;
+    PublishSnapshot (sim, (float)(GetWallTime () - start));
+}
+
+static void *RunSimulationThread (void *data)
+{
+    Simulation *sim = data;
+    SET_ALLOC_PHASE (ALLOC_PHASE_SIM);
+
+    pthread_mutex_lock (&sim->lock);
+
+    for (;;)
+    {
+        while (sim->pending == 0 && !sim->quit) pthread_cond_wait (&sim->wake, &sim->lock);
+        if (sim->quit) break;
+
+        SimInput input = sim->inputs[sim->head];
+        sim->head = (sim->head + 1) % SIM_QUEUE_DEPTH;
+        sim->pending--;
+        sim->busy = true;
+        pthread_mutex_unlock (&sim->lock);
+
+        SimulateTick (sim, &input);
+
+        pthread_mutex_lock (&sim->lock);
+        sim->busy = false;
+        pthread_cond_broadcast (&sim->done);
+    }
+
+    pthread_mutex_unlock (&sim->lock);
+    return NULL;
+}
+
+static void StartSimulation (Simulation *sim, bool threaded)
+{
+    sim->tick = 0;
+    sim->posted = 0;
+    sim->head = 0;
+    sim->pending = 0;
+    sim->busy = false;
+    sim->quit = false;
+    sim->writing = 0;
+    sim->reading = 1;
+    atomic_init (&sim->middle, 2);
+
+    pthread_mutex_init (&sim->lock, NULL);
+    pthread_cond_init (&sim->wake, NULL);
+    pthread_cond_init (&sim->done, NULL);
+
+    sim->threaded = threaded && pthread_create (&sim->thread, NULL, RunSimulationThread, sim) == 0;
+    TraceLog (LOG_INFO, "SIMULATION: Ticks run %s", sim->threaded ? "on their own thread" : "on the main thread");
+}
+
+// Queues the next tick. Blocks while the simulation is a full queue behind, so the frame rate follows
+// the slower of simulation and rendering instead of their sum.
+static void PostSimInput (Simulation *sim, const SimInput *input)
+{
+    sim->posted++;
+
+    if (!sim->threaded)
+    {
+        SET_ALLOC_PHASE (ALLOC_PHASE_SIM);
+        SimulateTick (sim, input);
+        SET_ALLOC_PHASE (ALLOC_PHASE_UPDATE);
+        return;
+    }
+
+    pthread_mutex_lock (&sim->lock);
+    while (sim->pending == SIM_QUEUE_DEPTH) pthread_cond_wait (&sim->done, &sim->lock);
+
+    sim->inputs[(sim->head + sim->pending) % SIM_QUEUE_DEPTH] = *input;
+    sim->pending++;
+    pthread_cond_signal (&sim->wake);
+    pthread_mutex_unlock (&sim->lock);
+}
+
+// Returns once every queued tick has run, after that the main thread may touch the gameplay state
+static void WaitSimulationIdle (Simulation *sim)
+{
+    if (!sim->threaded) return;
+
+    pthread_mutex_lock (&sim->lock);
+    while (sim->pending > 0 || sim->busy) pthread_cond_wait (&sim->done, &sim->lock);
+    pthread_mutex_unlock (&sim->lock);
+}
+
+static void StopSimulation (Simulation *sim)
+{
+    if (sim->threaded)
+    {
+        pthread_mutex_lock (&sim->lock);
+        sim->quit = true;
+        pthread_cond_signal (&sim->wake);
+        pthread_mutex_unlock (&sim->lock);
+        pthread_join (sim->thread, NULL);
+    }
+
+    pthread_mutex_destroy (&sim->lock);
+    pthread_cond_destroy (&sim->wake);
+    pthread_cond_destroy (&sim->done);
+}
+
+// Soak test
+
+static void InitSoakTest (SoakTest *soak, int minutes, const char *path)
+{
+    *soak = (SoakTest){ 0 };
+    soak->enabled = minutes > 0;
+    soak->sampleStride = 1;
+    soak->minutes = minutes;
+    soak->start = GetWallTime ();
+
+    if (!soak->enabled) return;
+
+    soak->csv = fopen (path, "w");
+    if (soak->csv == NULL) TraceLog (LOG_WARNING, "SOAK: Could not write %s, only the summary is logged", path);
+    else fprintf (soak->csv, "minute,wall_s,rss_kb,heap_used_kb,heap_total_kb,enemies,bullets,particles_peak,frame_p50_ms,frame_p99_ms,frame_max_ms\n");
+
+    TraceLog (LOG_INFO, "SOAK: Running %d game minutes", minutes);
+}
+
+static bool IsSoakDone (const SoakTest *soak)
+{
+    return soak->enabled && soak->minute >= soak->minutes;
+}
+
+// The bot ends every game after SOAK_GAME_SECONDS, so world resets are soaked too
+static bool IsSoakGameOver (const SoakTest *soak)
+{
+    return soak->enabled && soak->gameClock >= SOAK_GAME_SECONDS;
+}
+
+// Replaces the player's input: circles the arena, sweeps the aim around, fires all the time and
+// cycles through the weapons
+static void GetSoakBotInput (SoakTest *soak, SimInput *tick, Rectangle player)
+{
+    float t = soak->botTime;
+    soak->botTime += tick->dt;
+
+    Vector2 center = { player.x + player.width/2.0f, player.y + player.height/2.0f };
+    tick->move = (Vector2){ cosf (t*0.7f), sinf (t*1.1f) };
+    tick->aim = (Vector2){ center.x + 200.0f*cosf (t*3.0f), center.y + 200.0f*sinf (t*3.0f) };
+    tick->triggerHeld = true;
+    tick->weapon = (int)(t / SOAK_WEAPON_SECONDS) % WEAPON_COUNT;
+
+    // Four clicks a second for the weapons that need them
+    tick->clickCount = 0;
+    if ((int)(soak->botTime*4.0f) != (int)(t*4.0f))
+    {
+        tick->clickAim[0] = tick->aim;
+        tick->clickAge[0] = 0.0f;
+        tick->clickCount = 1;
+    }
+}
+
+static size_t GetResidentBytes (void)
+{
+#if defined(__linux__)
+    // statm: program size then resident set, in pages
+    char text[128] = { 0 };
+    int file = open ("/proc/self/statm", O_RDONLY);
+    if (file < 0) return 0;
+
+    ssize_t length = read (file, text, sizeof (text) - 1);
+    close (file);
+
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (length <= 0 || sscanf (text, "%lu %lu", &size, &resident) != 2) return 0;
+
+    return resident * (size_t)sysconf (_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+static void GetHeapBytes (size_t *used, size_t *total)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2 ();
+    *used = info.uordblks + info.hblkhd;
+    *total = info.arena + info.hblkhd;
+#else
+    *used = 0;
+    *total = 0;
+#endif
+}
+
+static float GetSoakFramePercentile (const SoakTest *soak, float fraction)
+{
+    int target = (int)ceilf (fraction * soak->frameCount);
+    int seen = 0;
+
+    for (int i = 0; i < SOAK_FRAME_BINS; i++)
+    {
+        seen += soak->frameBins[i];
+        if (seen >= target) return (i + 1) * 0.1f;
+    }
+
+    return soak->frameMax;
+}
 
-// 1. Enumerations and Structures
-// Define a GameState enum: MENU, GAMEPLAY, SETTINGS, etc.
+// Once per frame after EndDrawing, writes a row every game minute
+// Keeps samples for the trend summary, warm-up minutes left out. A full array drops every other sample and
+// doubles the stride, so a run of any length keeps evenly spaced samples over all of it.
+static void RecordSoakSample (SoakTest *soak, SoakSample sample)
+{
+    if (sample.minute <= SOAK_WARMUP_MINUTES || (sample.minute - SOAK_WARMUP_MINUTES - 1) % soak->sampleStride != 0) return;
 
-typedef enum
+    if (soak->sampleCount == SOAK_MAX_SAMPLES)
+    {
+        for (int i = 0; i < SOAK_MAX_SAMPLES/2; i++) soak->samples[i] = soak->samples[2*i];
+        soak->sampleCount = SOAK_MAX_SAMPLES/2;
+        soak->sampleStride *= 2;
+    }
+
+    soak->samples[soak->sampleCount++] = sample;
+}
+
+static void UpdateSoakTest (SoakTest *soak, GameState state, float frameTime, const FrameSnapshot *snapshot)
 {
-    STATE_START,
-    STATE_MENU, 
-    STATE_GAMEPLAY,
-    STATE_GAMEOVER
-} GameState;
+    if (!soak->enabled) return;
 
-// Define Player struct
-typedef struct Player
+    int bin = (int)(frameTime * 10000.0f);
+    soak->frameBins[(bin < SOAK_FRAME_BINS) ? bin : SOAK_FRAME_BINS]++;
+    soak->frameCount++;
+    soak->frameMax = fmaxf (soak->frameMax, frameTime * 1000.0f);
+    soak->particlePeak = (snapshot->particles > soak->particlePeak) ? snapshot->particles : soak->particlePeak;
+
+    soak->gameClock = (state == STATE_GAMEPLAY) ? soak->gameClock + SOAK_TICK : 0.0f;
+    soak->clock += SOAK_TICK;
+    if (soak->clock < 60.0f) return;
+
+    SoakSample sample = { 0 };
+    sample.minute = ++soak->minute;
+    sample.wallTime = GetWallTime () - soak->start;
+    sample.resident = GetResidentBytes ();
+    GetHeapBytes (&sample.heapUsed, &sample.heapTotal);
+    sample.enemies = snapshot->enemies;
+    sample.bullets = snapshot->bullets;
+    sample.particlePeak = soak->particlePeak;
+    sample.frameP50 = GetSoakFramePercentile (soak, 0.5f);
+    sample.frameP99 = GetSoakFramePercentile (soak, 0.99f);
+    sample.frameMax = soak->frameMax;
+
+    RecordSoakSample (soak, sample);
+
+    if (soak->csv != NULL)
+    {
+        fprintf (soak->csv, "%d,%.1f,%zu,%zu,%zu,%d,%d,%d,%.1f,%.1f,%.1f\n", soak->minute, sample.wallTime, sample.resident/1024,
+            sample.heapUsed/1024, sample.heapTotal/1024, sample.enemies, sample.bullets, sample.particlePeak,
+            sample.frameP50, sample.frameP99, sample.frameMax);
+        fflush (soak->csv);
+    }
+
+    TraceLog (LOG_INFO, "SOAK: Minute %d of %d, %.0f s, %zu KB resident, frame p99 %.1f ms", soak->minute, soak->minutes,
+        sample.wallTime, sample.resident/1024, sample.frameP99);
+
+    memset (soak->frameBins, 0, sizeof (soak->frameBins));
+    soak->frameCount = 0;
+    soak->frameMax = 0.0f;
+    soak->clock -= 60.0f;
+}
+
+// Least squares slope of evenly spaced values, per step
+static double GetTrendSlope (const double *values, int count)
 {
-    Vector2 position;
-    Vector2 direction;
-    float speed;
-    int health;
-    int maxHealth;
-    int dollars;
-    Rectangle rect;
-} Player;
+    double sumX = 0.0, sumY = 0.0, sumXY = 0.0, sumXX = 0.0;
 
-typedef struct PlayerHud
+    for (int i = 0; i < count; i++)
+    {
+        sumX += i;
+        sumY += values[i];
+        sumXY += i*values[i];
+        sumXX += (double)i*i;
+    }
+
+    double denominator = count*sumXX - sumX*sumX;
+    return (denominator != 0.0) ? (count*sumXY - sumX*sumY) / denominator : 0.0;
+}
+
+// Flags memory that keeps growing and a frame time tail that keeps getting longer
+static void LogSoakReport (SoakTest *soak)
 {
-    Rectangle healthBar;
-    Rectangle backgroundBar;
-    float maxHealth;
-    
-    Vector2 dollarsPosition;
-    int fontSize;
-    Color moneyColor;
-} PlayerHud;
+    if (!soak->enabled) return;
+    if (soak->csv != NULL) fclose (soak->csv);
+    soak->csv = NULL;
+
+    if (soak->sampleCount < 5)
+    {
+        TraceLog (LOG_INFO, "SOAK: %d minutes is too short for a trend, the first %d are warm-up", soak->minute, SOAK_WARMUP_MINUTES);
+        return;
+    }
+
+    const SoakSample *start = &soak->samples[0];
+    const SoakSample *end = &soak->samples[soak->sampleCount - 1];
+    int count = soak->sampleCount;
+    int span = end->minute - start->minute;
+
+    static double resident[SOAK_MAX_SAMPLES];
+    static double heap[SOAK_MAX_SAMPLES];
+    static double tail[SOAK_MAX_SAMPLES];
+
+    for (int i = 0; i < count; i++)
+    {
+        resident[i] = start[i].resident / 1024.0;
+        heap[i] = start[i].heapUsed / 1024.0;
+        tail[i] = start[i].frameP99;
+    }
+
+    // Per minute, samples are sampleStride minutes apart
+    double residentSlope = GetTrendSlope (resident, count) / soak->sampleStride;
+    double heapSlope = GetTrendSlope (heap, count) / soak->sampleStride;
+    double tailSlope = GetTrendSlope (tail, count) / soak->sampleStride;
+
+    TraceLog (LOG_INFO, "SOAK: %d minutes in %.0f s. Resident %zu -> %zu KB (%+.1f KB/min), heap %zu -> %zu KB (%+.1f KB/min), frame p99 %.1f -> %.1f ms (%+.3f ms/min)",
+        soak->minute, end->wallTime, start->resident/1024, end->resident/1024, residentSlope, start->heapUsed/1024, end->heapUsed/1024,
+        heapSlope, start->frameP99, end->frameP99, tailSlope);
+
+    // A trend counts once it adds up to something over the run, a steady wobble does not
+    bool flagged = false;
+
+    if (residentSlope > 0.0 && residentSlope*span > 1024.0)
+    {
+        TraceLog (LOG_WARNING, "SOAK: Resident memory grows %.1f KB per minute, possible leak", residentSlope);
+        flagged = true;
+    }
 
-typedef struct Bullet
+    if (heapSlope > 0.0 && heapSlope*span > 256.0)
+    {
+        TraceLog (LOG_WARNING, "SOAK: Heap in use grows %.1f KB per minute, possible leak or fragmentation", heapSlope);
+        flagged = true;
+    }
+
+    if (tailSlope > 0.0 && tailSlope*span > fmaxf (0.5f, 0.2f*start->frameP99))
+    {
+        TraceLog (LOG_WARNING, "SOAK: Frame time p99 grows %.3f ms per minute", tailSlope);
+        flagged = true;
+    }
+
+    if (!flagged) TraceLog (LOG_INFO, "SOAK: No upward trend in memory or frame time tail");
+}
+
+// Renderer bench
+
+static void InitBenchRun (BenchRun *bench, int frames, int wave)
 {
-    Vector2 position;
-    Vector2 direction;
-    bool active;
-    float speed;
-    float radius;
-    int damage;
-} Bullet;
+    *bench = (BenchRun){ 0 };
+    bench->enabled = frames > 0;
+    bench->frames = frames;
+    bench->wave = wave;
+
+    if (bench->enabled) TraceLog (LOG_INFO, "BENCH: Drawing %d frames of wave %d (%d enemies)", frames, wave, waves[wave].count);
+}
 
-typedef struct Enemy
+static bool IsBenchDone (const BenchRun *bench)
 {
-    Vector2 position;
-    Vector2 direction;
-    bool active;
-    float speed;
-    int health;
-    int bounty;
-    Rectangle rect;
-} Enemy;
+    return bench->enabled && bench->measured >= bench->frames;
+}
 
+// Once per frame after EndDrawing, quads is how many sprites the frame pushed
+static void UpdateBenchRun (BenchRun *bench, GameState state, const SpriteBatch *batch, int quads, float frameTime)
+{
+    if (!bench->enabled || state != STATE_GAMEPLAY) return;
 
-typedef struct MenuButton
+    int expectedCalls = (quads + batch->capacity - 1) / batch->capacity;
+    if (batch->drawCalls != expectedCalls || batch->vertices != quads*6) bench->mismatches++;
+
+    bench->quads = quads;
+    bench->drawCalls += batch->drawCalls;
+    bench->vertices += batch->vertices;
+    bench->frameTime += frameTime;
+    bench->measured++;
+}
+
+// Reads the last frame back before it is presented and samples the center of every enemy nothing else covers.
+// Call after EndGameViewport: the sprites are then flushed to the internal target, or to the screen without one.
+static void CheckBenchFrame (BenchRun *bench, GameState state, const FrameSnapshot *snapshot, Camera2D camera, const GameViewport *viewport, Rectangle hud)
 {
-    Rectangle rect;
-    const char *text;
-    int fontSize;
-    int textWidth;
-    bool isHovered;
-    Color buttonColor;
-} MenuButton;
+    if (!bench->enabled || state != STATE_GAMEPLAY || bench->measured != bench->frames - 1) return;
+
+    // Render textures are stored upside down, the screen may have more pixels than logical ones on high DPI
+    Image frame = viewport->enabled ? LoadImageFromTexture (viewport->target.texture) : LoadImageFromScreen ();
+    if (viewport->enabled) ImageFlipVertical (&frame);
+
+    float density = viewport->enabled ? 1.0f : (float)frame.width / GetScreenWidth ();
+    Camera2D view = GetViewportCamera (viewport, camera);
+    Rectangle covered = { hud.x*viewport->scale, hud.y*viewport->scale, hud.width*viewport->scale, hud.height*viewport->scale };
+
+    for (int i = 0; i < snapshot->spriteCount; i++)
+    {
+        const SnapshotSprite *sprite = &snapshot->sprites[i];
+        if (sprite->kind != COMPONENT_ENEMY || sprite->alpha != 255) continue;
+
+        Vector2 center = { sprite->bounds.x + sprite->bounds.width/2.0f, sprite->bounds.y + sprite->bounds.height/2.0f };
+        bool hidden = CheckCollisionPointRec (center, snapshot->player);
+        for (int j = i + 1; j < snapshot->spriteCount && !hidden; j++) hidden = CheckCollisionPointRec (center, snapshot->sprites[j].bounds);
+
+        Vector2 pixel = GetWorldToScreen2D (center, view);
+        if (hidden || CheckCollisionPointRec (pixel, covered)) continue;
+
+        int x = (int)(pixel.x*density);
+        int y = (int)(pixel.y*density);
+        if (x < 0 || y < 0 || x >= viewport->width*density || y >= viewport->height*density) continue;
+
+        Color expected = enemyTypes[sprite->type].color;
+        Color seen = GetImageColor (frame, x, y);
+        bench->pixelsChecked++;
+
+        if (abs (seen.r - expected.r) > BENCH_COLOR_TOLERANCE || abs (seen.g - expected.g) > BENCH_COLOR_TOLERANCE ||
+            abs (seen.b - expected.b) > BENCH_COLOR_TOLERANCE) bench->pixelsWrong++;
+    }
+
+    UnloadImage (frame);
+}
+
+// Returns false if the bench did not finish, the batch split its quads over more calls than needed, or the
+// last frame did not show the enemies it should have
+static bool LogBenchReport (const BenchRun *bench)
+{
+    if (!bench->enabled) return true;
+
+    if (bench->measured < bench->frames)
+    {
+        TraceLog (LOG_WARNING, "BENCH: Stopped after %d of %d frames", bench->measured, bench->frames);
+        return false;
+    }
+
+    TraceLog (LOG_INFO, "BENCH: %d frames, %d sprites per frame: %.1f draw calls and %.0f vertices per frame, %.2f ms per frame",
+        bench->measured, bench->quads, (double)bench->drawCalls / bench->measured, (double)bench->vertices / bench->measured,
+        bench->frameTime*1000.0 / bench->measured);
+
+    if (bench->mismatches > 0) TraceLog (LOG_WARNING, "BENCH: %d frames drew their sprites in more calls than needed", bench->mismatches);
+
+    if (bench->pixelsChecked == 0) TraceLog (LOG_WARNING, "BENCH: No enemy could be found on the last frame");
+    else if (bench->pixelsWrong > 0) TraceLog (LOG_WARNING, "BENCH: %d of %d enemies had the wrong color on the last frame", bench->pixelsWrong, bench->pixelsChecked);
+    else TraceLog (LOG_INFO, "BENCH: All %d enemies sampled on the last frame had their color", bench->pixelsChecked);
+
+    return bench->mismatches == 0 && bench->pixelsChecked > 0 && bench->pixelsWrong == 0;
+}
+
+// Game states
+
+// Starting a game always starts from scratch, whichever state it comes from
+static void EnterGameplay (GameSession *session)
+{
+    Player *player = session->player;
+    player->health = player->maxHealth;
+    player->dollars = 0;
+    player->weapon = WEAPON_PISTOL;
+    player->nextShot = 0.0f;
+    player->shotQueued = false;
+    player->droppedShots = 0;
+    player->position = session->spawnPoint;
+    player->rect.x = player->position.x;
+    player->rect.y = player->position.y;
+
+    // Clear the enemies and restart from the first wave
+    ClearWorld (session->world);
+    ResetWaveSpawner (session->spawner);
+
+    // The bench wave comes out whole and in the same places every run
+    if (session->benchWave >= 0)
+    {
+        const WaveDef *wave = &waves[session->benchWave];
+        Vector2 center = { player->position.x + PLAYER_WIDTH/2.0f, player->position.y + PLAYER_HEIGHT/2.0f };
+
+        SetRandomSeed (BENCH_SEED);
+        for (int i = 0; i < wave->count; i++) SpawnEnemy (session->world, wave->type, GetWaveSpawnPosition (wave, center));
+    }
+
+    // The simulation is idle outside gameplay, the first frame draws this snapshot
+    PublishSnapshot (session->sim, 0.0f);
+}
+
+// Nothing may touch the gameplay state behind a running tick
+static void ExitGameplay (GameSession *session)
+{
+    WaitSimulationIdle (session->sim);
+}
+
+// Only the start screen draws the logo and only gameplay draws the sprites. The screens leading to
+// gameplay prefetch its atlas, so starting a game does not wait on it.
+static const StateDef stateDefs[] =
+{
+    [STATE_LOADING]  = { "loading",   0,                       0,                      NULL,          NULL },
+    [STATE_START]    = { "start",     ATLAS_BIT (ATLAS_TITLE), ATLAS_BIT (ATLAS_GAME), NULL,          NULL },
+    [STATE_MENU]     = { "menu",      0,                       ATLAS_BIT (ATLAS_GAME), NULL,          NULL },
+    [STATE_GAMEPLAY] = { "gameplay",  ATLAS_BIT (ATLAS_GAME),  0,                      EnterGameplay, ExitGameplay },
+    [STATE_GAMEOVER] = { "game over", 0,                       ATLAS_BIT (ATLAS_GAME), NULL,          NULL },
+};
 
+// Clicks queued before the change belong to the screen being left, NEW GAME must not fire a shot
+static void EnterState (StateMachine *machine, GameSession *session, GameState next)
+{
+    machine->current = next;
+    ClearInputQueue (session->input);
+    if (stateDefs[next].enter != NULL) stateDefs[next].enter (session);
+}
+
+// Leaves the current state and releases what the next one does not use. Goes through STATE_LOADING
+// while the next state's resources are still missing.
+static void ChangeState (StateMachine *machine, GameResources *resources, GameSession *session, GameState next)
+{
+    if (stateDefs[machine->current].exit != NULL) stateDefs[machine->current].exit (session);
+
+    RequestResources (resources, stateDefs[next].needs | stateDefs[next].prefetch);
+
+    if (ResourcesReady (resources, stateDefs[next].needs)) EnterState (machine, session, next);
+    else
+    {
+        machine->current = STATE_LOADING;
+        machine->target = next;
+    }
+}
+
+// Once per frame, before the state update
+static void UpdateStateMachine (StateMachine *machine, GameResources *resources, GameSession *session)
+{
+    UpdateResources (resources);
+
+    if (machine->current == STATE_LOADING && ResourcesReady (resources, stateDefs[machine->target].needs))
+    {
+        EnterState (machine, session, machine->target);
+    }
+}
 
-int main (void)
+
+int main (int argc, char *argv[])
 {
     // 2. Current game state
 
-    GameState currentState = STATE_START;
+    double launchTime = GetWallTime ();
+    GameConfig config = ParseGameConfig (argc, argv);
+
+    // Offline asset steps, need no window
+    if (config.packAtlas != NULL) return ExportSpriteAtlas (config.packAtlas) ? 0 : 1;
+    if (config.buildPack != NULL) return BuildAssetPack (config.buildPack) ? 0 : 1;
 
     // 3. Initialization
     // Init window and audio
     // Set Target FPS
 
-    SetConfigFlags(FLAG_VSYNC_HINT);
+    if (config.pacing != PACING_UNCAPPED) SetConfigFlags(FLAG_VSYNC_HINT);
     InitWindow (0, 0, "Bounty Trails");
     ToggleFullscreen();
-    SetTargetFPS (60);
+
+    FramePacer pacer;
+    InitFramePacer (&pacer, config.idleAware, config.pacing);
     float screenWidth = GetScreenWidth ();
     float screenHeight = GetScreenHeight ();
 
-    Image icon = LoadImage ("resources/images/icon.png");
-    SetWindowIcon (icon);
-    UnloadImage (icon);
+    // Atlases come from the mapped pack when there is one, PNGs decoded on worker threads otherwise.
+    // Each state says which ones it needs, they are uploaded a slice per frame.
+    static GameResources resources;
+    InitGameResources (&resources, config.noPack ? NULL : config.packPath);
+
+    // Bullets and enemies are drawn through one vertex buffer
+    static SpriteBatch spriteBatch;
+    InitSpriteBatch (&spriteBatch, SPRITE_BATCH_QUADS);
+    bool showDebug = false;
 
-    Texture2D logoTexture = LoadTexture ("resources/images/logo.png");
+    // Dynamic resolution allocates the target at its upper bound and starts there
+    GameViewport viewport;
+    DynamicResolution dynamicResolution;
+    int renderHeight = config.dynamicResolution ? (int)(config.maxRenderScale * screenHeight) : config.renderHeight;
+    InitGameViewport (&viewport, screenWidth, screenHeight, renderHeight);
+    InitDynamicResolution (&dynamicResolution, config.dynamicResolution, config.minRenderScale, config.maxRenderScale, 1.0f / 60.0f);
+    float renderTime = 0.0f;            // BeginDrawing to EndDrawing returning, last frame
+
+    // The world is drawn through the camera, only what it sees gets drawn
+    Camera2D camera = { 0 };
+    camera.offset = (Vector2){ screenWidth / 2.0f, screenHeight / 2.0f };
+    camera.target = (Vector2){ screenWidth / 2.0f, screenHeight / 2.0f };
+    camera.zoom = 1.0f;
+
+    static SpatialGrid grid;
+    static VisibleSet visible;
+    grid.count = 0;
+    visible.count = 0;
+    visible.culled = 0;
+
+    // Layout of static UI strings, reused every frame
+    static TextCache textCache;
+    InitTextCache (&textCache);
+
+    // Clicks are queued one per press with their time instead of merging into one per frame
+    InputQueue input;
+    InitInputQueue (&input, &viewport);
+
+    // Strings and other scratch data that only live for one frame
+    FrameArena frameArena;
+    InitFrameArena (&frameArena, FRAME_ARENA_BYTES, config.poisonArena);
+
+    LatencyProbe latencyProbe;
+    InitLatencyProbe (&latencyProbe, config.latencyProbe);
+
+    static SoakTest soak;
+    InitSoakTest (&soak, config.soakMinutes, config.soakPath);
+
+    BenchRun bench;
+    InitBenchRun (&bench, config.benchFrames, config.benchWave);
 
     // Setup values for new game button
     MenuButton newGame;
@@ -108,7 +4131,7 @@ int main (void)
     newGame.rect.y = screenHeight / 2.0f - newGame.rect.height / 2.0f;
     newGame.text = "NEW GAME";
     newGame.fontSize  = 40;
-    newGame.textWidth = MeasureText (newGame.text, newGame.fontSize);
+    newGame.textWidth = MeasureCachedText (&textCache, newGame.text, newGame.fontSize);
     newGame.isHovered = false;
     newGame.buttonColor = DARKBROWN;
    
@@ -119,6 +4142,10 @@ int main (void)
     player.health = 100;
     player.maxHealth = 100;
     player.dollars = 0;
+    player.weapon = WEAPON_PISTOL;
+    player.nextShot = 0.0f;
+    player.shotQueued = false;
+    player.droppedShots = 0;
     player.rect = (Rectangle){ player.position.x, player.position.y, PLAYER_WIDTH, PLAYER_HEIGHT };
     player.rect.x = player.position.x;
     player.rect.y = player.position.y;
@@ -138,202 +4165,147 @@ int main (void)
     playerHUD.fontSize = 40;
     playerHUD.moneyColor = DARKGREEN;
 
-    // Setup initial values for bullets
-    Bullet bullet[MAX_BULLETS];
-    for (int i = 0; i < MAX_BULLETS; i++)
-    {
-        bullet[i].position;
-        bullet[i].direction;
-        bullet[i].active = false;
-        bullet[i].speed = 600.0f;
-        bullet[i].radius = BULLET_RADIUS;
-        bullet[i].damage = 100;
-    }
-
-    // Setup initial values for enemies
-    Enemy enemy[5];
-    for (int i = 0; i < 5; i++)
-    {
-        enemy[i].position.x = 100 + (i * 120);
-        enemy[i].position.y = 50;
-        enemy[i].direction;
-        enemy[i].active = true;
-        enemy[i].speed = 50.0f;
-        enemy[i].health = 100;
-        enemy[i].bounty = 10;
-        enemy[i].rect = (Rectangle){ enemy[i].position.x, enemy[i].position.y, ENEMY_WIDTH, ENEMY_HEIGHT };
-        enemy[i].rect.x = enemy[i].position.x;
-        enemy[i].rect.y = enemy[i].position.y;
-    }
+    // The HUD is drawn into its own texture, large enough for the bars and a long dollar count
+    CachedLayer hudLayer;
+    InitCachedLayer (&hudLayer, (Rectangle){ 0.0f, 0.0f, 480.0f, 140.0f });
+
+    // Setup the entity store, enemies only enter the game through the wave spawner
+    static World world;
+    InitWorld (&world);
+
+    WaveSpawner spawner;
+    ResetWaveSpawner (&spawner);
     
     
     // Vector 2 position bounds
     Vector2 minBounds = { 0, 0 };
     Vector2 maxBounds = { screenWidth - PLAYER_WIDTH, screenHeight - PLAYER_HEIGHT };
+
+    // Gameplay ticks run on their own thread, the render loop draws the snapshots they publish
+    static Simulation sim;
+    sim.player = &player;
+    sim.world = &world;
+    sim.spawner = &spawner;
+    sim.grid = &grid;
+    sim.visible = &visible;
+    sim.screenWidth = screenWidth;
+    sim.screenHeight = screenHeight;
+    sim.minBounds = minBounds;
+    sim.maxBounds = maxBounds;
+    sim.view = GetCameraView (camera, screenWidth, screenHeight);
+    StartSimulation (&sim, config.simThread);
+
+    // The window shows the loading screen until the start screen's atlas is in
+    GameSession session = { &player, player.position, &world, &spawner, &sim, &input, bench.enabled ? bench.wave : -1 };
+    StateMachine machine = { STATE_LOADING, STATE_LOADING };
+    ChangeState (&machine, &resources, &session, STATE_START);
     
+    bool firstFrame = true;
+    bool startupReady = false;
+    const FrameSnapshot *snapshot = AcquireSnapshot (&sim);
+    int gameplayFrames = 0;     // Since gameplay was entered, the first ALLOC_WARMUP_FRAMES may allocate
+    int frameAllocations = 0;
+
     // Game Loop
-    while (!WindowShouldClose()) {
+    while (!WindowShouldClose() && !IsSoakDone (&soak) && !IsBenchDone (&bench)) {
+
+        ResetFrameArena (&frameArena);
+
+        // Long waits (event waiting, dragging the window) must not turn into one huge simulation step
+        float dt = soak.enabled ? SOAK_TICK : fminf (GetFrameTime (), MAX_FRAME_TIME);
+        bool paused = pacer.idleAware && machine.current == STATE_GAMEPLAY && !IsWindowFocused ();
+
+        SET_ALLOC_PHASE (ALLOC_PHASE_INPUT);
+        PumpInput (&input, false);
+        if (WaitForFrameDeadline (&pacer, machine.current, paused)) PumpInput (&input, true);
+
+        SET_ALLOC_PHASE (ALLOC_PHASE_UPDATE);
+        UpdateStateMachine (&machine, &resources, &session);
+
+        if (!startupReady && machine.current != STATE_LOADING)
+        {
+            TraceLog (LOG_INFO, "STARTUP: Start screen ready %.1f ms after launch", (GetWallTime () - launchTime)*1000.0);
+            startupReady = true;
+        }
         
         // Update Logic (Decision making based on State)
-        switch (currentState)
+        switch (machine.current)
         {
         case STATE_START:
 
-            if (IsKeyPressed (KEY_ENTER))
+            if (WasKeyPressed (&input, KEY_ENTER) || soak.enabled || bench.enabled)
             {
-                currentState = STATE_MENU;
+                ChangeState (&machine, &resources, &session, STATE_MENU);
             }
 
             break;
 
         case STATE_MENU:
-            newGame.isHovered = CheckCollisionPointRec (GetMousePosition (), newGame.rect);
+            newGame.isHovered = CheckCollisionPointRec (GetViewportMouse (&viewport), newGame.rect);
             newGame.buttonColor = (newGame.isHovered) ? MAROON : DARKBROWN;
 
-            if (newGame.isHovered && IsMouseButtonPressed (MOUSE_LEFT_BUTTON)) 
+            if ((newGame.isHovered && WasMousePressed (&input)) || soak.enabled || bench.enabled) 
             {
-                currentState = STATE_GAMEPLAY;
+                ChangeState (&machine, &resources, &session, STATE_GAMEPLAY);
             }
             
             break;
 
         case STATE_GAMEPLAY:
-            
-            // Player centre, useful for managing aim e bullet shooting logic
-            Vector2 playerCenter = 
-            { 
-                player.position.x + PLAYER_WIDTH/2.0f, 
-                player.position.y + PLAYER_HEIGHT/2.0f 
-            };
 
-            // Shoot
-            if (IsMouseButtonPressed (MOUSE_LEFT_BUTTON)) 
+            // Input is sampled here, raylib only reads it on the main thread. The tick runs while this frame draws.
+            if (!paused)
             {
-                for (int i = 0; i < MAX_BULLETS; i++) 
-                {
-                    if (!bullet[i].active) // Find bullet not active
-                    { 
-                        bullet[i].active = true;
-                        bullet[i].position = playerCenter;
-            
-                        Vector2 target = GetMousePosition ();
-                        Vector2 diff = Vector2Subtract (target, playerCenter);
-                        bullet[i].direction = Vector2Normalize (diff);
-            
-                        break; // Stop in order to not shoot all 50 bullets
-                    }
-                }
-            }
+                SimInput tick = { 0 };
+                tick.dt = dt;
+                tick.move.x = (float)IsKeyDown (KEY_D) - (float)IsKeyDown (KEY_A);
+                tick.move.y = (float)IsKeyDown (KEY_S) - (float)IsKeyDown (KEY_W);
+                tick.triggerHeld = IsMouseButtonDown (MOUSE_LEFT_BUTTON);
+                tick.aim = GetScreenToWorld2D (GetViewportMouse (&viewport), camera);
+                tick.weapon = -1;
 
-            // Update all bullets in the pool
-            for (int i = 0; i < MAX_BULLETS; i++) 
-            {
-                // Only update the bullet if it is currently in flight
-                if (bullet[i].active) 
+                // Keys 1 to 3 pick the weapon
+                for (int w = 0; w < WEAPON_COUNT; w++)
                 {
-                    // Calculate new position based on direction and speed
-                    bullet[i].position.x += bullet[i].direction.x * bullet[i].speed * GetFrameTime();
-                    bullet[i].position.y += bullet[i].direction.y * bullet[i].speed * GetFrameTime();
-
-                    // Check if the bullet has left the screen boundaries
-                    // We include the radius to ensure it's completely out of sight before deactivating
-                    if (bullet[i].position.x < -bullet[i].radius || 
-                    bullet[i].position.x > screenWidth + bullet[i].radius ||
-                    bullet[i].position.y < -bullet[i].radius || 
-                    bullet[i].position.y > screenHeight + bullet[i].radius) 
-                    {
-                        // Set to false so this slot can be reused by a new shot
-                        bullet[i].active = false;
-                    }
+                    if (WasKeyPressed (&input, KEY_ONE + w)) tick.weapon = w;
                 }
-            }
 
-            // Check collision: Bullets vs Enemies
-            for (int i = 0; i < MAX_BULLETS; i++) 
-            {
-                if (bullet[i].active) 
+                // Clicks past SIM_MAX_CLICKS stay queued for the next tick
+                double now = GetTime ();
+                InputEvent event;
+
+                while (tick.clickCount < SIM_MAX_CLICKS && TakeInputEvent (&input, &event))
                 {
-                    for (int j = 0; j < 5; j++) 
-                    {
-                        if (enemy[j].active) 
-                        {
-                            // Check if the bullet circle overlaps the enemy rectangle
-                            if (CheckCollisionCircleRec (bullet[i].position, bullet[i].radius, enemy[j].rect)) 
-                            {
-                                // 1. Deactivate the bullet
-                                bullet[i].active = false;
-                    
-                                // 2. Subtract damage from enemy health
-                                enemy[j].health -= bullet[i].damage;
-                    
-                                // 3. Check if enemy is dead
-                                if (enemy[j].health <= 0) 
-                                {
-                                    enemy[j].active = false;
-                                    player.dollars += enemy[j].bounty; // Reward the player!
-                                }
-                    
-                                break; // Exit the enemy loop since the bullet is gone
-                            }
-                        }
-                    }
+                    tick.clickAim[tick.clickCount] = GetScreenToWorld2D (event.position, camera);
+                    tick.clickAge[tick.clickCount] = Clamp ((float)(now - event.time), 0.0f, dt);
+                    tick.clickCount++;
+                    TagLatencyInput (&latencyProbe, event.time, sim.posted + 1);
                 }
-            }
-        
-            // Player death
-            if (player.health <= 0)
-            {
-                currentState = STATE_GAMEOVER;
-            }
 
-            // Player movement
-            if (IsKeyDown (KEY_W))
-            {
-                player.position.y -= player.speed * GetFrameTime ();
-            }
-            
-            if (IsKeyDown (KEY_S))
-            {
-                player.position.y += player.speed * GetFrameTime ();
-            }
-            
-            if (IsKeyDown (KEY_A))
-            {
-                player.position.x -= player.speed * GetFrameTime ();
+                if (soak.enabled) GetSoakBotInput (&soak, &tick, snapshot->player);
+
+                // The bench wave stays where it spawned, every tick still rebuilds and culls the grid
+                if (bench.enabled) tick = (SimInput){ .dt = 0.0f, .weapon = -1 };
+
+                PostSimInput (&sim, &tick);
+
+                // Low latency draws this frame's tick instead of overlapping it with the drawing
+                if (pacer.mode == PACING_LOW_LATENCY) WaitSimulationIdle (&sim);
             }
 
-            if (IsKeyDown (KEY_D))
+            // Player death
+            if (AcquireSnapshot (&sim)->playerDead || IsSoakGameOver (&soak))
             {
-                player.position.x += player.speed * GetFrameTime ();
+                ChangeState (&machine, &resources, &session, STATE_GAMEOVER);
             }
             
-            // Keep player inside the bounds
-            player.position = Vector2Clamp (player.position, minBounds, maxBounds);
-
-            // Player location on screen
-            player.rect.x = player.position.x;
-            player.rect.y = player.position.y;
-            
             break;
 
         case STATE_GAMEOVER:
 
-            if (IsKeyPressed (KEY_ENTER))
+            if (WasKeyPressed (&input, KEY_ENTER) || soak.enabled)
             {
-                currentState = STATE_MENU; // Back to MENU
-                player.health = 100; // Revive player
-                player.dollars = 0; // Reset player's dollars
-                player.position = (Vector2){ screenWidth / 2.0f, screenHeight / 2.0f }; // Reset player's spawn
-
-                // Revive enemies and reset enemies' spawn
-                for (int i = 0; i < 5; i++)
-                {
-                    enemy[i].health = 100;
-                    enemy[i].active = true;
-                    enemy[i].position.x = 100 + (i * 120);
-                    enemy[i].position.y = 50;
-                }
-                
+                ChangeState (&machine, &resources, &session, STATE_MENU); // Back to MENU, the next game starts fresh
             }
             
             break;
@@ -342,86 +4314,135 @@ int main (void)
             break;
         }
 
+        if (WasKeyPressed (&input, KEY_F3)) showDebug = !showDebug;
+
+        // Clicks outside unpaused gameplay never turn into shots
+        ResetInputFrame (&input);
+        if (machine.current != STATE_GAMEPLAY || paused) ClearInputQueue (&input);
+
+        UpdateFramePacer (&pacer, machine.current, paused, IsLoadingResources (&resources));
+
+        // Throttled screens would read as slow frames, only gameplay drives the resolution
+        if (machine.current == STATE_GAMEPLAY && !paused)
+        {
+            float renderScale = UpdateDynamicResolution (&dynamicResolution, GetFrameTime (), renderTime);
+            if (dynamicResolution.enabled) SetViewportHeight (&viewport, (int)(renderScale * screenHeight));
+        }
+
+        // Newest finished tick, a state entered this frame has already published its first one
+        if (machine.current == STATE_GAMEPLAY) snapshot = AcquireSnapshot (&sim);
+
+        SET_ALLOC_PHASE (ALLOC_PHASE_DRAW);
+
         // Rendering (Drawing based on State)
+        double drawStart = GetWallTime ();
         BeginDrawing ();
+
+        // Redraw cached layers whose values changed, before the viewport takes over the render target
+        if (machine.current == STATE_GAMEPLAY)
+        {
+            if (BeginCachedLayer (&hudLayer, &snapshot->hud, sizeof (snapshot->hud)))
+            {
+                DrawPlayerHud (&playerHUD, &snapshot->hud, &textCache, &frameArena);
+                EndCachedLayer ();
+            }
+        }
+
+        BeginGameViewport (&viewport);
             
-            switch (currentState)
+            switch (machine.current)
             {
+            case STATE_LOADING:
+                ClearBackground (BEIGE);
+                BeginMode2D (viewport.uiCamera);
+
+                const char *loadingText = "Loading";
+                Rectangle loadingBar = { screenWidth / 2.0f - 300.0f, screenHeight * 0.6f, 600.0f, 30.0f };
+                DrawCachedText (&textCache, loadingText, screenWidth / 2 - MeasureCachedText (&textCache, loadingText, 40) / 2, loadingBar.y - 60, 40, DARKBROWN);
+                DrawRectangleRec (loadingBar, Fade (DARKBROWN, 0.3f));
+                DrawRectangle (loadingBar.x, loadingBar.y, loadingBar.width * GetResourcesProgress (&resources, stateDefs[machine.target].needs), loadingBar.height, DARKBROWN);
+
+                EndMode2D ();
+                break;
+
             case STATE_START:
                 float logoScale = 2.5f;
+                Rectangle logoSource = GetAtlasSprite (&resources.atlas[ATLAS_TITLE], "logo");
             
                 ClearBackground (BEIGE); 
-                DrawTextureEx (
-                    logoTexture, 
-                    (Vector2){ GetScreenWidth () / 2.0f - (logoTexture.width * logoScale) / 2.0f, GetScreenHeight () / 10.0f }, 
+                BeginMode2D (viewport.uiCamera);
+                DrawTexturePro (
+                    resources.atlas[ATLAS_TITLE].texture, 
+                    logoSource,
+                    (Rectangle){ screenWidth / 2.0f - (logoSource.width * logoScale) / 2.0f, screenHeight / 10.0f, logoSource.width * logoScale, logoSource.height * logoScale }, 
+                    (Vector2){ 0.0f, 0.0f }, 
                     0.0f, 
-                    logoScale, 
                     WHITE
                 );
 
                 const char *startText = "Press ENTER to start";
                 int fontSize = 60;
-                int textWidth = MeasureText (startText, fontSize);
+                int textWidth = MeasureCachedText (&textCache, startText, fontSize);
                 float alpha = (sinf (GetTime () * 2.0f) + 1.0f) / 2.0f;
 
-                DrawText (startText, GetScreenWidth() / 2 - textWidth / 2, GetScreenHeight () * 0.75f, fontSize, Fade (BLACK, alpha));
+                DrawCachedText (&textCache, startText, screenWidth / 2 - textWidth / 2, screenHeight * 0.75f, fontSize, Fade (BLACK, alpha));
+                EndMode2D ();
                 break;
 
             case STATE_MENU:
                 ClearBackground (BEIGE);
+                BeginMode2D (viewport.uiCamera);
                 
                 DrawRectangleRec (newGame.rect, newGame.buttonColor);
 
                 float textX = newGame.rect.x + (newGame.rect.width / 2.0f - newGame.textWidth / 2.0f);
                 float textY = newGame.rect.y + (newGame.rect.height / 2.0f - newGame.fontSize / 2.0f);
-                DrawText (newGame.text, textX, textY, newGame.fontSize, BEIGE);
+                DrawCachedText (&textCache, newGame.text, textX, textY, newGame.fontSize, BEIGE);
+                EndMode2D ();
                 break;
 
             case STATE_GAMEPLAY:
                 ClearBackground (WHITE);
 
-                // Draw the player
-                DrawRectangleRec (player.rect, GREEN);
+                BeginMode2D (GetViewportCamera (&viewport, camera));
 
-                // Draw player's HUD
-                // Background bar
-                DrawRectangleRec (playerHUD.backgroundBar, GRAY);
-
-                // Health bar
-                float healthPercent = (float)player.health / (float)player.maxHealth;
-                playerHUD.healthBar.width = healthPercent * playerHUD.backgroundBar.width;
+                    // Bullets and enemies go first, everything drawn through raylib's own batch lands on top of them
+                    const SpriteAtlas *gameAtlas = &resources.atlas[ATLAS_GAME];
+                    Rectangle spriteCircle = GetAtlasUV (gameAtlas, "circle");
+                    Rectangle solidArea = GetAtlasUV (gameAtlas, "solid");
+                    Rectangle spriteSolid = { solidArea.x + solidArea.width/2.0f, solidArea.y + solidArea.height/2.0f, 0.0f, 0.0f };
 
-                Color healthColor = GREEN;
-                if (healthPercent <= 0.5f && healthPercent > 0.3f) healthColor = YELLOW;
-                else if (healthPercent <= 0.3f) healthColor = RED;
-                DrawRectangleRec (playerHUD.healthBar, healthColor);
-                
-                // Dollars
-                DrawText (
-                    TextFormat ("$: %d", player.dollars), 
-                    playerHUD.dollarsPosition.x, 
-                    playerHUD.dollarsPosition.y, 
-                    playerHUD.fontSize, 
-                    playerHUD.moneyColor
-                );
+                    SetSpriteBatchTexture (&spriteBatch, gameAtlas->texture);
+                    BeginSpriteBatch (&spriteBatch);
 
-                // Loop through the bullet pool and draw each active bullet
-                for (int i = 0; i < MAX_BULLETS; i++) 
-                {
-                    if (bullet[i].active) 
+                    for (int i = 0; i < snapshot->spriteCount; i++)
                     {
-                        DrawCircleV (bullet[i].position, bullet[i].radius, BLACK);
+                        const SnapshotSprite *sprite = &snapshot->sprites[i];
+
+                        if (sprite->kind == COMPONENT_BULLET) PushSprite (&spriteBatch, sprite->bounds, spriteCircle, bulletTypes[sprite->type].color);
+                        else PushSprite (&spriteBatch, sprite->bounds, spriteSolid, Fade (enemyTypes[sprite->type].color, sprite->alpha / 255.0f));
                     }
-                }
 
-                // Draw the enemies
-                for (int i = 0; i < 5; i++) 
+                    FlushSpriteBatch (&spriteBatch);
+
+                    // Draw the player
+                    DrawRectangleRec (snapshot->player, GREEN);
+
+                EndMode2D ();
+
+                BeginMode2D (viewport.uiCamera);
+
+                // Draw player's HUD
+                DrawCachedLayer (&hudLayer);
+
+                if (paused)
                 {
-                    if (enemy[i].active) 
-                    {
-                        DrawRectangleRec (enemy[i].rect, RED);
-                    }
+                    const char *pausedText = "PAUSED";
+                    DrawRectangle (0, 0, screenWidth, screenHeight, Fade (BLACK, 0.4f));
+                    DrawCachedText (&textCache, pausedText, screenWidth / 2 - MeasureCachedText (&textCache, pausedText, 60) / 2, screenHeight / 2 - 30, 60, WHITE);
                 }
+
+                EndMode2D ();
                 break;
 
             case STATE_GAMEOVER:
@@ -432,13 +4453,83 @@ int main (void)
                 break;
             }
 
+        EndGameViewport (&viewport);
+        CheckBenchFrame (&bench, machine.current, snapshot, camera, &viewport, hudLayer.bounds);
+
+            if (showDebug)
+            {
+                DrawFPS (GetScreenWidth () - 100, 10);
+                DrawText (ArenaFormat (&frameArena, "Enemies: %d", snapshot->enemies), GetScreenWidth () - 260, 40, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Bullets: %d, clicks dropped: %d", snapshot->bullets, snapshot->droppedShots), GetScreenWidth () - 260, 60, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Batch: %d draws, %d verts", spriteBatch.drawCalls, spriteBatch.vertices), GetScreenWidth () - 260, 80, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Drawn: %d, culled: %d", snapshot->spriteCount, snapshot->culled), GetScreenWidth () - 260, 100, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Particles: %d", snapshot->particles), GetScreenWidth () - 260, 310, 20, DARKGRAY);
+                if (frameAllocations >= 0) DrawText (ArenaFormat (&frameArena, "Allocations: %d last frame", frameAllocations), GetScreenWidth () - 260, 330, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Render: %dx%d (%.2f)", viewport.width, viewport.height, viewport.scale), GetScreenWidth () - 260, 120, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "HUD redraws: %d", hudLayer.redraws), GetScreenWidth () - 260, 210, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Text layouts: %d, reused: %d", textCache.misses, textCache.hits), GetScreenWidth () - 260, 230, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Tick %u: %.2f ms", snapshot->tick, snapshot->tickTime*1000.0f), GetScreenWidth () - 260, 250, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Pacing: %s, %.1f ms", pacingModeNames[pacer.mode], pacer.predicted*1000.0f), GetScreenWidth () - 260, 270, 20, DARKGRAY);
+                DrawText (ArenaFormat (&frameArena, "Frame arena: %zu B, peak %zu B", frameArena.used, frameArena.peak), GetScreenWidth () - 260, 290, 20, DARKGRAY);
+                DrawFrameTimeGraph (&dynamicResolution, GetScreenWidth () - 260, 145, 60);
+            }
+
+            // Anything but the default pacing changes how the game feels, so it is always on screen
+            if (pacer.mode != PACING_VSYNC)
+            {
+                const char *pacingText = ArenaFormat (&frameArena, "Pacing: %s", pacingModeNames[pacer.mode]);
+                DrawCachedText (&textCache, pacingText, GetScreenWidth () - MeasureCachedText (&textCache, pacingText, 20) - 20, GetScreenHeight () - 30, 20, DARKGRAY);
+            }
+
+            if (latencyProbe.enabled && latencyProbe.count > 0)
+            {
+                DrawText (ArenaFormat (&frameArena, "Click to present (%s): p50 %d ms, p99 %d ms", pacingModeNames[pacer.mode], GetLatencyPercentile (&latencyProbe, 0.5f), GetLatencyPercentile (&latencyProbe, 0.99f)), 20, GetScreenHeight () - 30, 20, DARKGRAY);
+            }
+
+        SET_ALLOC_PHASE (ALLOC_PHASE_PRESENT);
+        MarkFrameSubmitted (&pacer);
         EndDrawing ();
+        MarkFramePresented (&pacer);
+        renderTime = (float)(pacer.presented - drawStart);
+
+        SET_ALLOC_PHASE (ALLOC_PHASE_OTHER);
+        gameplayFrames = (machine.current == STATE_GAMEPLAY) ? gameplayFrames + 1 : 0;
+        frameAllocations = EndAllocFrame (gameplayFrames > ALLOC_WARMUP_FRAMES);
+        UpdateSoakTest (&soak, machine.current, GetFrameTime (), snapshot);
+        UpdateBenchRun (&bench, machine.current, &spriteBatch, snapshot->spriteCount, GetFrameTime ());
+
+        // Clicks of a game that ended are never shown
+        if (machine.current == STATE_GAMEPLAY) ResolveLatencyProbe (&latencyProbe, snapshot->tick, GetTime ());
+        else latencyProbe.pendingCount = 0;
+
+        if (firstFrame)
+        {
+            TraceLog (LOG_INFO, "STARTUP: First frame %.1f ms after launch", (GetWallTime () - launchTime)*1000.0);
+            firstFrame = false;
+        }
     }
 
     // De-Initialization
     // Unload textures/sounds
-    UnloadTexture(logoTexture);
+    StopSimulation (&sim);
+    LogLatencyReport (&latencyProbe, pacingModeNames[pacer.mode]);
+    LogAllocReport ();
+    LogSoakReport (&soak);
+    bool benchPassed = LogBenchReport (&bench);
+    ResetFrameArena (&frameArena);
+    TraceLog (LOG_INFO, "FRAME ARENA: Peak of %zu bytes in one frame, %d allocations did not fit", frameArena.peak, frameArena.failed);
+    UnloadFrameArena (&frameArena);
+    UnloadGameResources (&resources);
+    TraceLog (LOG_INFO, "SPRITE BATCH: Peak of %d draw calls and %d vertices in one frame", spriteBatch.peakDrawCalls, spriteBatch.peakVertices);
+    UnloadSpriteBatch (&spriteBatch);
+#if defined(POOL_STATS)
+    TraceLog (LOG_INFO, "WORLD: Peak of %d/%d chunks and %d/%d handles, %d chunk and %d handle acquires failed",
+        world.chunks.peak, MAX_CHUNKS, world.handles.peak, MAX_ENTITIES, world.chunks.failed, world.handles.failed);
+#endif
+    UnloadGameViewport (&viewport);
+    UnloadCachedLayer (&hudLayer);
+    UnloadInputQueue (&input);
     CloseWindow ();
 
-    return 0;
+    return benchPassed ? 0 : 1;
 }
\ No newline at end of file